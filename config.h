@@ -31,10 +31,22 @@ static const char *colors[][3] = {
 static const int gapi = 8;             /* 窗口与窗口间隔 */
 static const int gapo = 12;            /* 窗口与屏幕边的距离 */
 static const int defaulttag = 5;       /* 默认选中的tag的下标 */
+static const int focusdwell = 0;       /* 鼠标进入窗口后停留多少毫秒才聚焦，0 为本批事件中最后进入的窗口，-1 立即聚焦 */
 static const int systraypinning = 0;   /* 托盘跟随的显示器 0代表不指定显示器 */
 static const int systrayspacing = 2;   /* 托盘间距 */
 static int showsystray = 1;            /* 是否显示托盘栏 */
 static const char *overviewsymbol = "";
+static const unsigned int statusinterval = 100; /* 两次读取 root 窗口名的最短间隔(ms)，期间的更新被合并 */
+
+/* 内置状态栏：独立线程读取 /proc 和 /sys，不启动任何进程，块与状态 socket 上的相同 */
+static const int statusthread = 0;     /* 1 启用；有块时不再显示 root 窗口名 */
+static const StatusItem statusitems[] = {
+    /* name    function     format             interval(ms)  color */
+    { "cpu",   st_cpu,      " %d%% ",          2000,         NULL },
+    { "mem",   st_mem,      " %d%% ",          5000,         NULL },
+    { "bat",   st_battery,  " %s %d%% ",       30000,        NULL },
+    { "time",  st_time,     " %m-%d %H:%M ",   1000,         "#eeeeee00ff#37474F00d0" },
+};
 
 /* tagging */
 static const char *tags[] = { "", "", "", "", "", "", "", "﬏", "", "", "ﬄ", "﬐", "", "", ""}; // 最多 31 个
@@ -1,7 +1,12 @@
 /* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
 
@@ -10,6 +15,10 @@
 
 #define UTF_INVALID 0xFFFD
 #define UTF_SIZ     4
+#define CLRCACHE    (sizeof ((Drw *)0)->clrcache / sizeof ((Drw *)0)->clrcache[0])
+#define LENGTH(X)   (sizeof (X) / sizeof (X)[0])
+#define RUNWAYS     4
+#define FONTMAP     "dwm-fontmap 1"
 
 static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
 static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
@@ -60,6 +69,379 @@ utf8decode(const char *c, long *u, size_t clen)
 	return len;
 }
 
+/* Fallback fonts for codepoints no loaded font covers are matched by a
+ * worker thread, fontconfig can take a long time to scan. Until the match
+ * is back the glyph is drawn with the first font and drw->placeholder is
+ * set, the caller redraws once drw_fallback_collect reports a new font. */
+enum { FbNone, FbPending, FbMissing }; /* codepoint lookup state */
+
+typedef struct FbReq {
+	long codepoint;
+	FcPattern *pattern, *match;
+	char *file;         /* font remembered from an earlier session */
+	int index;
+	struct FbReq *next;
+} FbReq;
+
+typedef struct {
+	long start, end;    /* codepoint range */
+	char *file;
+	int index;
+} FbMap;
+
+typedef struct {
+	long codepoint;     /* 0 for a free slot */
+	int state;
+} FbSeen;
+
+struct Fallback {
+	int pipe[2];        /* wakes the main thread when a match is done */
+	pthread_t thread;
+	int started, quit;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	FbReq *queue, *done;
+	FbSeen *seen;       /* lookup state by codepoint, open addressing */
+	unsigned int nseen, seensize;
+	FbMap *map;         /* fallback fonts by codepoint range, persisted */
+	unsigned int nmap, mapsize;
+	char *mapdir, *mapkey;
+	int mapdirty;
+};
+
+static int *
+fallback_state(struct Fallback *fb, long codepoint)
+{
+	FbSeen *old = fb->seen;
+	unsigned int i, n = fb->seensize;
+
+	if (2 * (fb->nseen + 1) > fb->seensize) {
+		fb->seensize = n ? 2 * n : 64;
+		fb->seen = ecalloc(fb->seensize, sizeof(FbSeen));
+		fb->nseen = 0;
+		for (i = 0; i < n; i++)
+			if (old[i].codepoint)
+				*fallback_state(fb, old[i].codepoint) = old[i].state;
+		free(old);
+	}
+	for (i = (codepoint * 2654435761UL) & (fb->seensize - 1);
+	     fb->seen[i].codepoint && fb->seen[i].codepoint != codepoint;
+	     i = (i + 1) & (fb->seensize - 1))
+		;
+	if (!fb->seen[i].codepoint) {
+		fb->seen[i].codepoint = codepoint;
+		fb->seen[i].state = FbNone;
+		fb->nseen++;
+	}
+	return &fb->seen[i].state;
+}
+
+/* Codepoint ranges served by fallback fonts, kept in a cache file so the
+ * next start can open the font file directly instead of searching. The
+ * file is written when the map is replaced or freed, not while drawing. */
+static void
+fontmap_clear(struct Fallback *fb)
+{
+	unsigned int i;
+
+	for (i = 0; i < fb->nmap; i++)
+		free(fb->map[i].file);
+	free(fb->map);
+	fb->map = NULL;
+	fb->nmap = fb->mapsize = 0;
+}
+
+static FbMap *
+fontmap_find(struct Fallback *fb, long codepoint)
+{
+	unsigned int i;
+
+	for (i = 0; i < fb->nmap; i++)
+		if (BETWEEN(codepoint, fb->map[i].start, fb->map[i].end))
+			return &fb->map[i];
+	return NULL;
+}
+
+static void
+fontmap_add(struct Fallback *fb, long start, long end, const char *file, int index)
+{
+	FbMap *old = fb->map, *e;
+	unsigned int i;
+
+	for (i = 0; i < fb->nmap; i++) {
+		e = &fb->map[i];
+		if (e->index != index || strcmp(e->file, file))
+			continue;
+		if (BETWEEN(start, e->start, e->end + 1) || BETWEEN(end + 1, e->start, e->end)) {
+			e->start = MIN(e->start, start);
+			e->end = MAX(e->end, end);
+			fb->mapdirty = 1;
+			return;
+		}
+	}
+	if (fb->nmap == fb->mapsize) {
+		fb->mapsize = fb->mapsize ? 2 * fb->mapsize : 16;
+		fb->map = ecalloc(fb->mapsize, sizeof(FbMap));
+		if (old)
+			memcpy(fb->map, old, fb->nmap * sizeof(FbMap));
+		free(old);
+	}
+	e = &fb->map[fb->nmap++];
+	e->start = start;
+	e->end = end;
+	e->index = index;
+	e->file = ecalloc(strlen(file) + 1, 1);
+	strcpy(e->file, file);
+	fb->mapdirty = 1;
+}
+
+static void
+fontmap_drop(struct Fallback *fb, long codepoint)
+{
+	FbMap *e;
+
+	if (!(e = fontmap_find(fb, codepoint)))
+		return;
+	free(e->file);
+	*e = fb->map[--fb->nmap];
+	fb->mapdirty = 1;
+}
+
+static void
+fontmap_save(struct Fallback *fb)
+{
+	char path[4096], tmp[4096], *p;
+	unsigned int i;
+	FILE *fp;
+
+	fb->mapdirty = 0;
+	if (!fb->mapdir)
+		return;
+	for (p = fb->mapdir + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		mkdir(fb->mapdir, 0755);
+		*p = '/';
+	}
+	mkdir(fb->mapdir, 0755);
+	snprintf(path, sizeof path, "%s/fontmap", fb->mapdir);
+	snprintf(tmp, sizeof tmp, "%s/fontmap.%d", fb->mapdir, (int)getpid());
+	if (!(fp = fopen(tmp, "w")))
+		return;
+	fprintf(fp, FONTMAP " %s\n", fb->mapkey);
+	for (i = 0; i < fb->nmap; i++)
+		fprintf(fp, "%lx %lx %d %s\n", fb->map[i].start, fb->map[i].end,
+		        fb->map[i].index, fb->map[i].file);
+	if (fclose(fp) || rename(tmp, path))
+		unlink(tmp);
+}
+
+/* Read the map for the font set whose primary font is key. */
+static void
+fontmap_load(struct Fallback *fb, const char *key)
+{
+	const char *home;
+	char buf[4096], head[4096];
+	unsigned long start, end;
+	int index, n;
+	FILE *fp;
+
+	if (fb->mapdirty)
+		fontmap_save(fb);
+	fontmap_clear(fb);
+	free(fb->mapdir);
+	free(fb->mapkey);
+	fb->mapdir = fb->mapkey = NULL;
+	if ((home = getenv("XDG_CACHE_HOME")) && *home)
+		snprintf(buf, sizeof buf, "%s/dwm", home);
+	else if ((home = getenv("HOME")) && *home)
+		snprintf(buf, sizeof buf, "%s/.cache/dwm", home);
+	else
+		return;
+	fb->mapdir = ecalloc(strlen(buf) + 1, 1);
+	strcpy(fb->mapdir, buf);
+	fb->mapkey = ecalloc(strlen(key) + 1, 1);
+	strcpy(fb->mapkey, key);
+
+	snprintf(buf, sizeof buf, "%s/fontmap", fb->mapdir);
+	if (!(fp = fopen(buf, "r")))
+		return;
+	/* a map made for other fonts would pick the wrong fallbacks */
+	snprintf(head, sizeof head, FONTMAP " %s\n", key);
+	if (fgets(buf, sizeof buf, fp) && !strcmp(buf, head)) {
+		while (fgets(buf, sizeof buf, fp)) {
+			buf[strcspn(buf, "\n")] = '\0';
+			if (sscanf(buf, "%lx %lx %d %n", &start, &end, &index, &n) == 3 && buf[n])
+				fontmap_add(fb, start, end, buf + n, index);
+		}
+	}
+	fclose(fp);
+	fb->mapdirty = 0;
+}
+
+static void *
+fallback_worker(void *arg)
+{
+	struct Fallback *fb = arg;
+	FbReq *r;
+	FcPattern *font;
+	FcResult result;
+	int count;
+	char c = 0;
+
+	pthread_mutex_lock(&fb->lock);
+	while (1) {
+		while (!fb->queue && !fb->quit)
+			pthread_cond_wait(&fb->cond, &fb->lock);
+		if (fb->quit)
+			break;
+		r = fb->queue;
+		fb->queue = r->next;
+		pthread_mutex_unlock(&fb->lock);
+
+		FcConfigSubstitute(NULL, r->pattern, FcMatchPattern);
+		FcDefaultSubstitute(r->pattern);
+		/* a remembered font only needs its own file read */
+		if (r->file && (font = FcFreeTypeQuery((FcChar8 *)r->file, r->index, NULL, &count))) {
+			r->match = FcFontRenderPrepare(NULL, r->pattern, font);
+			FcPatternDestroy(font);
+		}
+		if (!r->match)
+			r->match = FcFontMatch(NULL, r->pattern, &result);
+
+		pthread_mutex_lock(&fb->lock);
+		r->next = fb->done;
+		fb->done = r;
+		/* if the pipe is full the main thread has not woken up yet */
+		(void)!write(fb->pipe[1], &c, 1);
+	}
+	pthread_mutex_unlock(&fb->lock);
+	return NULL;
+}
+
+static void
+fallback_request(Drw *drw, long codepoint)
+{
+	struct Fallback *fb = drw->fallback;
+	int *state = fallback_state(fb, codepoint);
+	FcCharSet *fccharset;
+	FbReq *r;
+	FbMap *e;
+	sigset_t all, old;
+
+	if (*state == FbMissing)
+		return;
+	drw->placeholder = 1;
+	if (*state == FbPending)
+		return;
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+	r = ecalloc(1, sizeof(FbReq));
+	r->codepoint = codepoint;
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, codepoint);
+	r->pattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(r->pattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(r->pattern, FC_SCALABLE, FcTrue);
+	FcCharSetDestroy(fccharset);
+	/* Xft defaults read the display, keep that on this thread */
+	XftDefaultSubstitute(drw->dpy, drw->screen, r->pattern);
+	if ((e = fontmap_find(fb, codepoint))) {
+		r->file = ecalloc(strlen(e->file) + 1, 1);
+		strcpy(r->file, e->file);
+		r->index = e->index;
+	}
+	*state = FbPending;
+
+	pthread_mutex_lock(&fb->lock);
+	r->next = fb->queue;
+	fb->queue = r;
+	if (!fb->started) {
+		/* dwm reads its signals from a signalfd, the thread must never
+		 * take one, so it is created with everything blocked */
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		if (pthread_create(&fb->thread, NULL, fallback_worker, fb))
+			die("pthread_create:");
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		fb->started = 1;
+	}
+	pthread_cond_signal(&fb->cond);
+	pthread_mutex_unlock(&fb->lock);
+}
+
+static void
+fallback_freereqs(FbReq *r)
+{
+	FbReq *next;
+
+	for (; r; r = next) {
+		next = r->next;
+		FcPatternDestroy(r->pattern);
+		if (r->match)
+			FcPatternDestroy(r->match);
+		free(r->file);
+		free(r);
+	}
+}
+
+static struct Fallback *
+fallback_create(void)
+{
+	struct Fallback *fb = ecalloc(1, sizeof(struct Fallback));
+
+	if (pipe(fb->pipe) < 0)
+		die("pipe:");
+	fcntl(fb->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(fb->pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(fb->pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fb->pipe[1], F_SETFD, FD_CLOEXEC);
+	pthread_mutex_init(&fb->lock, NULL);
+	pthread_cond_init(&fb->cond, NULL);
+	return fb;
+}
+
+static void
+fallback_free(struct Fallback *fb)
+{
+	if (fb->started) {
+		pthread_mutex_lock(&fb->lock);
+		fb->quit = 1;
+		pthread_cond_signal(&fb->cond);
+		pthread_mutex_unlock(&fb->lock);
+		pthread_join(fb->thread, NULL);
+	}
+	fallback_freereqs(fb->queue);
+	fallback_freereqs(fb->done);
+	close(fb->pipe[0]);
+	close(fb->pipe[1]);
+	pthread_mutex_destroy(&fb->lock);
+	pthread_cond_destroy(&fb->cond);
+	free(fb->seen);
+	if (fb->mapdirty)
+		fontmap_save(fb);
+	fontmap_clear(fb);
+	free(fb->mapdir);
+	free(fb->mapkey);
+	free(fb);
+}
+
+static void
+textrun_clear(Drw *drw)
+{
+	size_t i;
+
+	for (i = 0; i < LENGTH(drw->runs); i++) {
+		free(drw->runs[i].text);
+		free(drw->runs[i].glyphs);
+	}
+	memset(drw->runs, 0, sizeof(drw->runs));
+}
+
 Drw *
 drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h, Visual *visual, unsigned int depth, Colormap cmap)
 {
@@ -75,7 +457,12 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->cmap = cmap;
 	drw->drawable = XCreatePixmap(dpy, root, w, h, depth);
 	drw->gc = XCreateGC(dpy, drw->drawable, 0, NULL);
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, visual, cmap);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+	/* copies are between pixmaps and unobscured windows, no NoExpose needed */
+	XSetGraphicsExposures(dpy, drw->gc, False);
+
+	drw->fallback = fallback_create();
 
 	return drw;
 }
@@ -91,11 +478,21 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, drw->depth);
+	XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	size_t i;
+
+	for (i = 0; i < CLRCACHE; i++)
+		if (drw->clrcache[i].used)
+			XftColorFree(drw->dpy, drw->visual, drw->cmap, &drw->clrcache[i].clr);
+	fallback_free(drw->fallback);
+	textrun_clear(drw);
+	free(drw->specs);
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
 	drw_fontset_free(drw->fonts);
@@ -148,14 +545,167 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 static void
 xfont_free(Fnt *font)
 {
+	size_t i;
+
 	if (!font)
 		return;
+	for (i = 0; i < LENGTH(font->adv); i++)
+		free(font->adv[i]);
+	free(font->astral);
+	free(font->name);
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
-	XftFontClose(font->dpy, font->xfont);
+	if (font->xfont)
+		XftFontClose(font->dpy, font->xfont);
 	free(font);
 }
 
+/* Open a font of the set that was only named so far. Returns 0 if it
+ * cannot be loaded, it is not retried then. */
+static int
+xfont_load(Drw *drw, Fnt *font)
+{
+	Fnt *tmp;
+
+	if (font->xfont)
+		return 1;
+	if (!font->name || !(tmp = xfont_create(drw, font->name, NULL))) {
+		free(font->name);
+		font->name = NULL;
+		return 0;
+	}
+	font->xfont = tmp->xfont;
+	font->pattern = tmp->pattern;
+	font->h = tmp->h;
+	free(tmp);
+	free(font->name);
+	font->name = NULL;
+	return 1;
+}
+
+static short *
+xfont_astralslot(Fnt *font, long codepoint)
+{
+	FntAdv *old = font->astral;
+	unsigned int i, n = font->astralsize;
+
+	if (2 * (font->nastral + 1) > font->astralsize) {
+		font->astralsize = n ? 2 * n : 64;
+		font->astral = ecalloc(font->astralsize, sizeof(FntAdv));
+		font->nastral = 0;
+		for (i = 0; i < n; i++)
+			if (old[i].codepoint)
+				*xfont_astralslot(font, old[i].codepoint) = old[i].adv;
+		free(old);
+	}
+	for (i = (codepoint * 2654435761UL) & (font->astralsize - 1);
+	     font->astral[i].codepoint && font->astral[i].codepoint != codepoint;
+	     i = (i + 1) & (font->astralsize - 1))
+		;
+	if (!font->astral[i].codepoint) {
+		font->astral[i].codepoint = codepoint;
+		font->astral[i].adv = -2;
+		font->nastral++;
+	}
+	return &font->astral[i].adv;
+}
+
+/* Horizontal advance of codepoint in font, -1 if the font has no glyph for
+ * it. The answer is asked from Xft once and then kept in the font. */
+static int
+xfont_advance(Drw *drw, Fnt *font, long codepoint)
+{
+	short *slot;
+	size_t i;
+	FcChar32 c = codepoint;
+	XGlyphInfo ext;
+
+	if (codepoint < 0x10000) {
+		if (!font->adv[codepoint >> 8]) {
+			font->adv[codepoint >> 8] = ecalloc(256, sizeof(short));
+			for (i = 0; i < 256; i++)
+				font->adv[codepoint >> 8][i] = -2;
+		}
+		slot = &font->adv[codepoint >> 8][codepoint & 0xff];
+	} else {
+		slot = xfont_astralslot(font, codepoint);
+	}
+	if (*slot == -2 && !xfont_load(drw, font))
+		return -1;
+	if (*slot == -2) {
+		if (XftCharExists(drw->dpy, font->xfont, c)) {
+			XftTextExtents32(drw->dpy, font->xfont, &c, 1, &ext);
+			*slot = ext.xOff;
+		} else {
+			*slot = -1;
+		}
+	}
+	return *slot;
+}
+
+int
+drw_fallback_fd(Drw *drw)
+{
+	return drw && drw->fallback ? drw->fallback->pipe[0] : -1;
+}
+
+/* Add the fonts matched since the last call. Returns nonzero if text drawn
+ * with placeholders should be drawn again. */
+int
+drw_fallback_collect(Drw *drw)
+{
+	struct Fallback *fb;
+	FbReq *r, *done;
+	Fnt *f, *cur;
+	FcChar8 *file;
+	char buf[64];
+	int index, redraw = 0;
+
+	if (!drw || !(fb = drw->fallback))
+		return 0;
+	while (read(fb->pipe[0], buf, sizeof buf) > 0)
+		;
+	pthread_mutex_lock(&fb->lock);
+	done = fb->done;
+	fb->done = NULL;
+	pthread_mutex_unlock(&fb->lock);
+
+	for (r = done; r; r = r->next) {
+		/* an earlier match may already cover it */
+		for (f = drw->fonts; f && xfont_advance(drw, f, r->codepoint) < 0; f = f->next)
+			;
+		if (!f && r->match && (f = xfont_create(drw, NULL, r->match))) {
+			r->match = NULL; /* owned by the font now */
+			if (xfont_advance(drw, f, r->codepoint) >= 0) {
+				for (cur = drw->fonts; cur->next; cur = cur->next)
+					; /* NOP */
+				cur->next = f;
+				redraw = 1;
+			} else {
+				xfont_free(f);
+				f = NULL;
+			}
+		}
+		if (!f && r->file) {
+			/* the remembered font changed, search again */
+			fontmap_drop(fb, r->codepoint);
+			*fallback_state(fb, r->codepoint) = FbNone;
+			redraw = 1;
+			continue;
+		}
+		/* fonts from fonts[] carry a pattern, matched ones do not */
+		if (f && !f->pattern
+		&& FcPatternGetString(f->xfont->pattern, FC_FILE, 0, &file) == FcResultMatch) {
+			if (FcPatternGetInteger(f->xfont->pattern, FC_INDEX, 0, &index) != FcResultMatch)
+				index = 0;
+			fontmap_add(fb, r->codepoint, r->codepoint, (char *)file, index);
+		}
+		*fallback_state(fb, r->codepoint) = f ? FbNone : FbMissing;
+	}
+	fallback_freereqs(done);
+	return redraw;
+}
+
 Fnt*
 drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 {
@@ -165,12 +715,24 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 	if (!drw || !fonts)
 		return NULL;
 
+	/* only the primary font is opened now, the others on first use */
 	for (i = 1; i <= fontcount; i++) {
-		if ((cur = xfont_create(drw, fonts[fontcount - i], NULL))) {
-			cur->next = ret;
-			ret = cur;
-		}
+		cur = ecalloc(1, sizeof(Fnt));
+		cur->dpy = drw->dpy;
+		cur->name = ecalloc(strlen(fonts[fontcount - i]) + 1, 1);
+		strcpy(cur->name, fonts[fontcount - i]);
+		cur->next = ret;
+		ret = cur;
+	}
+	/* fonts[i] is the primary once loaded, the fontmap belongs to it */
+	for (i = 0; ret && !xfont_load(drw, ret); i++) {
+		cur = ret->next;
+		xfont_free(ret);
+		ret = cur;
 	}
+	textrun_clear(drw);
+	if (ret)
+		fontmap_load(drw->fallback, fonts[i]);
 	return (drw->fonts = ret);
 }
 
@@ -196,6 +758,54 @@ drw_clr_create(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha)
 	dest->pixel = (dest->pixel & 0x00ffffffU) | (alpha << 24);
 }
 
+/* Like drw_clr_create, but for "#RRGGBB" names the color comes from a small
+ * LRU cache owned by drw. Misses are allocated by value, which needs no server
+ * round trip on TrueColor visuals, and evicted colors are freed. dest is a
+ * copy and stays usable until the cached color is evicted. */
+void
+drw_clr_get(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha)
+{
+	size_t i, lru = 0;
+	unsigned int rgb;
+	char *end;
+	ClrSlot *s;
+	XRenderColor rc;
+
+	if (!drw || !dest || !clrname)
+		return;
+	if (clrname[0] != '#' || strlen(clrname) != 7
+	|| (rgb = strtoul(clrname + 1, &end, 16), *end)) {
+		drw_clr_create(drw, dest, clrname, alpha);
+		return;
+	}
+
+	for (i = 0; i < CLRCACHE; i++) {
+		s = &drw->clrcache[i];
+		if (s->used && s->rgb == rgb && s->alpha == alpha) {
+			s->used = ++drw->clrtick;
+			*dest = s->clr;
+			return;
+		}
+		if (s->used < drw->clrcache[lru].used)
+			lru = i;
+	}
+
+	s = &drw->clrcache[lru];
+	if (s->used)
+		XftColorFree(drw->dpy, drw->visual, drw->cmap, &s->clr);
+	rc.red = (rgb >> 16 & 0xff) * 0x101;
+	rc.green = (rgb >> 8 & 0xff) * 0x101;
+	rc.blue = (rgb & 0xff) * 0x101;
+	rc.alpha = 0xffff;
+	if (!XftColorAllocValue(drw->dpy, drw->visual, drw->cmap, &rc, &s->clr))
+		die("error, cannot allocate color '%s'", clrname);
+	s->clr.pixel = (s->clr.pixel & 0x00ffffffU) | (alpha << 24);
+	s->rgb = rgb;
+	s->alpha = alpha;
+	s->used = ++drw->clrtick;
+	*dest = s->clr;
+}
+
 /* Wrapper to create color schemes. The caller has to call free(3) on the
  * returned color scheme when done using it. */
 Clr *
@@ -216,8 +826,10 @@ drw_scm_create(Drw *drw, const char *clrnames[], const unsigned int alphas[], si
 void
 drw_setfontset(Drw *drw, Fnt *set)
 {
-	if (drw)
+	if (drw && drw->fonts != set) {
+		textrun_clear(drw);
 		drw->fonts = set;
+	}
 }
 
 void
@@ -239,24 +851,94 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+/* Look text up in the run cache, resolving it on a miss. Returns NULL if a
+ * codepoint is not covered by the loaded fonts, drw_text then takes the slow
+ * path which looks for a fallback font. */
+static TextRun *
+textrun_get(Drw *drw, const char *text)
+{
+	size_t i, set, charlen, len = 0, n = 0;
+	unsigned long hash = 2166136261UL;
+	long codepoint;
+	int adv, x = 0;
+	const char *t;
+	Fnt *f;
+	RunGlyph *glyphs;
+	TextRun *run, *lru;
+
+	for (t = text; *t; t++, len++)
+		hash = (hash ^ (unsigned char)*t) * 16777619UL;
+	set = (hash % (LENGTH(drw->runs) / RUNWAYS)) * RUNWAYS;
+	for (lru = run = &drw->runs[set], i = 0; i < RUNWAYS; i++, run++) {
+		if (run->text && run->fonts == drw->fonts && !strcmp(run->text, text)) {
+			run->used = ++drw->runtick;
+			return run;
+		}
+		if (run->used < lru->used)
+			lru = run;
+	}
+
+	glyphs = ecalloc(len ? len : 1, sizeof(RunGlyph));
+	for (t = text; *t; t += charlen, n++) {
+		if (!(charlen = utf8decode(t, &codepoint, UTF_SIZ)))
+			charlen = 1;
+		for (f = drw->fonts; f && (adv = xfont_advance(drw, f, codepoint)) < 0; f = f->next)
+			;
+		if (!f) {
+			free(glyphs);
+			return NULL;
+		}
+		glyphs[n].font = f;
+		glyphs[n].glyph = XftCharIndex(drw->dpy, f->xfont, codepoint);
+		glyphs[n].x = x;
+		x += adv;
+	}
+
+	free(lru->text);
+	free(lru->glyphs);
+	lru->text = ecalloc(len + 1, 1);
+	memcpy(lru->text, text, len);
+	lru->fonts = drw->fonts;
+	lru->glyphs = glyphs;
+	lru->len = n;
+	lru->w = x;
+	lru->used = ++drw->runtick;
+	return lru;
+}
+
+static void
+textrun_draw(Drw *drw, TextRun *run, int x, int y, unsigned int h, int invert)
+{
+	unsigned int i;
+	Fnt *f;
+
+	if (run->len > drw->specsize) {
+		free(drw->specs);
+		drw->specsize = run->len;
+		drw->specs = ecalloc(drw->specsize, sizeof(XftGlyphFontSpec));
+	}
+	for (i = 0; i < run->len; i++) {
+		f = run->glyphs[i].font;
+		drw->specs[i].font = f->xfont;
+		drw->specs[i].glyph = run->glyphs[i].glyph;
+		drw->specs[i].x = x + run->glyphs[i].x;
+		drw->specs[i].y = y + (h - f->h) / 2 + f->xfont->ascent;
+	}
+	XftDrawGlyphFontSpec(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg], drw->specs, run->len);
+}
+
 int
 drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
 {
-	int i, ty, ellipsis_x = 0;
+	int ty, adv, ellipsis_x = 0;
 	unsigned int tmpw, ew, ellipsis_w = 0, ellipsis_len;
 	XftDraw *d = NULL;
+	TextRun *run;
 	Fnt *usedfont, *curfont, *nextfont;
 	int utf8strlen, utf8charlen, render = x || y || w || h;
 	long utf8codepoint = 0;
 	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
 	int charexists = 0, overflow = 0;
-	/* keep track of a couple codepoints for which we have no match. */
-	enum { nomatches_len = 64 };
-	static struct { long codepoint[nomatches_len]; unsigned int idx; } nomatches;
 	static unsigned int ellipsis_width = 0;
 
 	if (!drw || (render && (!drw->scheme || !w)) || !text || !drw->fonts)
@@ -267,11 +949,18 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable, drw->visual, drw->cmap);
+		d = drw->xftdraw;
 		x += lpad;
 		w -= lpad;
 	}
 
+	/* text that fits and whose glyphs are all known takes one draw call */
+	if ((run = textrun_get(drw, text)) && run->w <= w) {
+		if (render && run->len)
+			textrun_draw(drw, run, x, y, h, invert);
+		return x + (render ? w : run->w);
+	}
+
 	usedfont = drw->fonts;
 	if (!ellipsis_width && render)
 		ellipsis_width = drw_fontset_getwidth(drw, "...");
@@ -282,9 +971,13 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 		while (*text) {
 			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
 			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
+				adv = xfont_advance(drw, curfont, utf8codepoint);
+				charexists = charexists || adv >= 0;
 				if (charexists) {
-					drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
+					if (adv >= 0)
+						tmpw = adv;
+					else /* drawn with a font lacking it, see below */
+						drw_font_getexts(curfont, text, utf8charlen, &tmpw, NULL);
 					if (ew + ellipsis_width <= w) {
 						/* keep track where the ellipsis still fits */
 						ellipsis_x = x + ew;
@@ -337,52 +1030,13 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 			usedfont = nextfont;
 		} else {
 			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
+			 * character must be drawn, with the first font until the
+			 * worker has matched one. */
 			charexists = 1;
-
-			for (i = 0; i < nomatches_len; ++i) {
-				/* avoid calling XftFontMatch if we know we won't find a match */
-				if (utf8codepoint == nomatches.codepoint[i])
-					goto no_match;
-			}
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					nomatches.codepoint[++nomatches.idx % nomatches_len] = utf8codepoint;
-no_match:
-					usedfont = drw->fonts;
-				}
-			}
+			fallback_request(drw, utf8codepoint);
+			usedfont = drw->fonts;
 		}
 	}
-	if (d)
-		XftDrawDestroy(d);
-
 	return x + (render ? w : 0);
 }
 
@@ -393,7 +1047,6 @@ drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
 		return;
 
 	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
 }
 
 unsigned int
@@ -4,17 +4,47 @@ typedef struct {
 	Cursor cursor;
 } Cur;
 
+typedef struct {
+	long codepoint; /* 0 for a free slot */
+	short adv;
+} FntAdv;
+
 typedef struct Fnt {
 	Display *dpy;
 	unsigned int h;
-	XftFont *xfont;
+	XftFont *xfont;     /* NULL until first use for all but the primary font */
 	FcPattern *pattern;
+	char *name;         /* to open it later, NULL once tried */
 	struct Fnt *next;
+	short *adv[256];    /* BMP advances by page of 256, -1 missing, -2 unknown */
+	FntAdv *astral;     /* advances above the BMP, open addressing */
+	unsigned int nastral, astralsize;
 } Fnt;
 
 enum { ColFg, ColBg, ColBorder }; /* Clr scheme index */
 typedef XftColor Clr;
 
+typedef struct {
+	Clr clr;
+	unsigned int rgb, alpha;
+	unsigned long used; /* last use, 0 for a free slot */
+} ClrSlot;
+
+typedef struct {
+	Fnt *font;
+	FT_UInt glyph;
+	int x;              /* offset from the start of the run */
+} RunGlyph;
+
+/* text resolved to glyphs of a font set, see drw_text */
+typedef struct {
+	char *text;         /* NULL for a free slot */
+	Fnt *fonts;
+	RunGlyph *glyphs;
+	unsigned int len, w;
+	unsigned long used;
+} TextRun;
+
 typedef struct {
 	unsigned int w, h;
 	Display *dpy;
@@ -27,6 +57,15 @@ typedef struct {
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	ClrSlot clrcache[32];
+	unsigned long clrtick;
+	XftDraw *xftdraw;
+	TextRun runs[256];  /* 64 sets of 4, LRU within a set */
+	unsigned long runtick;
+	XftGlyphFontSpec *specs;
+	unsigned int specsize;
+	struct Fallback *fallback; /* font fallback worker, see drw_text */
+	int placeholder;    /* drw_text drew a glyph whose font is still being matched */
 } Drw;
 
 /* Drawable abstraction */
@@ -41,8 +80,13 @@ unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
 unsigned int drw_fontset_getwidth_clamp(Drw *drw, const char *text, unsigned int n);
 void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
 
+/* Font fallback */
+int drw_fallback_fd(Drw *drw);
+int drw_fallback_collect(Drw *drw);
+
 /* Colorscheme abstraction */
 void drw_clr_create(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha);
+void drw_clr_get(Drw *drw, Clr *dest, const char *clrname, unsigned int alpha);
 Clr *drw_scm_create(Drw *drw, const char *clrnames[], const unsigned int alphas[], size_t clrcount);
 
 /* Cursor abstraction */
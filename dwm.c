@@ -20,18 +20,28 @@
  *
  * To understand everything else, start reading main().
  */
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <X11/cursorfont.h>
 #include <X11/keysym.h>
+#include <X11/XKBlib.h>
 #include <X11/XF86keysym.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
@@ -41,18 +51,47 @@
 #include <X11/extensions/Xinerama.h>
 #endif /* XINERAMA */
 #include <X11/Xft/Xft.h>
+#ifdef XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif /* XCB */
 
 #include "drw.h"
+#include "status.h"
 #include "util.h"
 
+#ifdef ROUNDTRIPS
+/* count the requests that block on a server reply, reported per event batch;
+ * only calls made from dwm.c are seen, round trips inside drw.c (Xft and
+ * fontconfig) and Xlib internals are not counted */
+static unsigned long roundtrips;
+#define XSync(...)                 (roundtrips++, XSync(__VA_ARGS__))
+#define XGetWindowProperty(...)    (roundtrips++, XGetWindowProperty(__VA_ARGS__))
+#define XGetTextProperty(...)      (roundtrips++, XGetTextProperty(__VA_ARGS__))
+#define XGetWMHints(...)           (roundtrips++, XGetWMHints(__VA_ARGS__))
+#define XGetWMNormalHints(...)     (roundtrips++, XGetWMNormalHints(__VA_ARGS__))
+#define XGetClassHint(...)         (roundtrips++, XGetClassHint(__VA_ARGS__))
+#define XGetTransientForHint(...)  (roundtrips++, XGetTransientForHint(__VA_ARGS__))
+#define XGetWindowAttributes(...)  (roundtrips++, XGetWindowAttributes(__VA_ARGS__))
+#define XGetModifierMapping(...)   (roundtrips++, XGetModifierMapping(__VA_ARGS__))
+#define XGetSelectionOwner(...)    (roundtrips++, XGetSelectionOwner(__VA_ARGS__))
+#define XGrabPointer(...)          (roundtrips++, XGrabPointer(__VA_ARGS__))
+#define XQueryPointer(...)         (roundtrips++, XQueryPointer(__VA_ARGS__))
+#define XQueryTree(...)            (roundtrips++, XQueryTree(__VA_ARGS__))
+#define ROUNDTRIP()                (roundtrips++)
+#else
+#define ROUNDTRIP()
+#endif /* ROUNDTRIPS */
+
 /* macros */
 #define BUTTONMASK (ButtonPressMask | ButtonReleaseMask)
 #define CLEANMASK(mask) (mask & ~(numlockmask | LockMask) & (ShiftMask | ControlMask | Mod1Mask | Mod2Mask | Mod3Mask | Mod4Mask | Mod5Mask))
+#define KEYMODS(mask) ((CLEANMASK(mask) & ShiftMask) | (CLEANMASK(mask) >> 1 & 0x7e)) /* cleaned mask without the Lock bit, 0..127 */
 #define INTERSECT(x, y, w, h, m) (MAX(0, MIN((x) + (w), (m)->wx + (m)->ww) - MAX((x), (m)->wx)) \
                                 * MAX(0, MIN((y) + (h), (m)->wy + (m)->wh) - MAX((y), (m)->wy)))
 #define ISVISIBLE(C) ((C->tags & C->mon->tagset[C->mon->seltags]))  // 判断窗口是否在选中 tag 上
 #define ISOVERVIEW(M) ((M->tagset[M->seltags] == overviewtags))
-#define HIDDEN(C) ((getstate(C->win) == IconicState))
+#define HIDDEN(C) ((C->state == IconicState))
 #define LENGTH(X) (sizeof X / sizeof X[0])
 #define MOUSEMASK (BUTTONMASK | PointerMotionMask)
 #define WIDTH(X) ((X)->w + 2 * (X)->bw)
@@ -72,6 +111,14 @@
 #define VERSION_MAJOR               0
 #define VERSION_MINOR               0
 #define XEMBED_EMBEDDED_VERSION (VERSION_MAJOR << 16) | VERSION_MINOR
+#define TIMERTICK                  10  /* ms per timer wheel slot */
+#define WHEELSIZE                  64  /* timer wheel slots */
+#define MAXBATCH                   64  /* X events handled before deferred work is flushed */
+#define PROPLEN                    1024L /* longest property read, in 32-bit units */
+#define FNV_OFFSET                 14695981039346656037UL
+#define FNV_PRIME                  1099511628211UL
+#define MAXBLOCKS                  32  /* status blocks */
+#define STATUSCONNS                8   /* concurrent status producers */
 
 /* enums */
 enum { CurNormal, CurResize, CurMove, CurLast }; /* cursor */
@@ -79,11 +126,17 @@ enum { SchemeNorm, SchemeSel, SchemeHid, SchemeNormTag, SchemeSelTag, SchemeBarE
 enum { NetSupported, NetWMName, NetWMState, NetWMCheck,
        NetSystemTray, NetSystemTrayOP, NetSystemTrayOrientation, NetSystemTrayOrientationHorz,
        NetWMFullscreen, NetActiveWindow, NetWMWindowType,
-       NetWMWindowTypeDialog, NetClientList, NetLast }; /* EWMH atoms */
+       NetWMWindowTypeDialog, NetClientList, NetClientListStacking, NetLast }; /* EWMH atoms */
 enum { Manager, Xembed, XembedInfo, XLast }; /* Xembed atoms */
 enum { WMProtocols, WMDelete, WMState, WMTakeFocus, WMClass, WMLast }; /* default atoms */
 enum { ClkTagBar, ClkLtSymbol, ClkStatusText, ClkWinTitle,
        ClkClientWin, ClkRootWin, ClkLast }; /* clicks */
+enum { WinClient, WinSystrayIcon, WinBar }; /* window registry kinds */
+enum { SegTags, SegLayout, SegTasks, SegStatus, SegLast }; /* bar segments */
+enum { PropWMClass, PropWMName, PropTransient, PropNetWMState, PropNetWMWindowType,
+       PropNormalHints, PropHints, PropWMState, PropWMProtocols, PropLast }; /* properties prefetched by manage() */
+enum { DirtyLayout = 1 << 0, DirtyStack = 1 << 1, DirtyBar = 1 << 2, DirtyPointer = 1 << 3,
+       DirtyClientList = 1 << 4, DirtySystray = 1 << 5, DirtyEnter = 1 << 6 }; /* deferred work, flushed once per event batch */
 
 typedef union {
     int i;
@@ -101,6 +154,14 @@ typedef struct {
 } Button;
 
 typedef struct Monitor Monitor;
+typedef struct {
+    Pixmap pix;         // 预渲染的内容
+    int x, w;           // 在 barwin 中的位置
+    unsigned long hash; // 渲染时内容的哈希
+    int shown;          // 当前内容已复制到 barwin
+    int dx, dw;         // 已显示后又重绘的部分，待复制到 barwin
+    int stale;          // 含有等待后备字体的字符
+} BarSeg;
 typedef struct Client Client;
 struct Client {
     char name[256];
@@ -112,8 +173,13 @@ struct Client {
     int taskw;  // 在状态栏的宽度
     unsigned int tags;
     int isfixed, isfloating, isurgent, neverfocus, oldstate, isfullscreen, isbottom, ishide;
-    Client *next;
-    Client *snext;
+    long state;           // 缓存的 WM_STATE，由 setclientstate 维护
+    int statepending;     // 尚未收到 PropertyNotify 的 WM_STATE 写入次数
+    unsigned int protocols; // 支持的 WM_PROTOCOLS，1 << WMDelete | 1 << WMTakeFocus
+    int grabbed;          // 当前按钮抓取对应的聚焦状态，-1 表示尚未抓取
+    Client *next, *prev;
+    Client *snext, *sprev;
+    Client *vnext, *vprev; // 可见窗口链表，仅在 ISVISIBLE 时有效
     Monitor *mon;
     Window win;
 };
@@ -139,16 +205,26 @@ struct Monitor {
     int mx, my, mw, mh; // monitor，显示器
     int wx, wy, ww, wh; // window，用于放置窗口的区域
     unsigned int bt;      /* number of tasks */
+    unsigned int tagcount[31]; // 每个 tag 上的窗口数
+    unsigned int urgcount[31]; // 每个 tag 上的紧急窗口数
+    unsigned int occ, urg;     // 有窗口、有紧急窗口的 tag
+    Client *vis, *vtail;       // 选中 tag 上的窗口，按 clients 顺序，由 visclients 重建
+    unsigned int vistags;      // vis 对应的 tagset
+    int visdirty;
     unsigned int seltags; // 选中的 tag，0 或 1，用于做 tagset 的下标
     unsigned int sellt; // 选中的 layout，0 或 1，用于做 lt 的下标
     unsigned int tagset[2]; // 保存两种 tag 状态
     int showbar; // 是否显示 bar
     int topbar;  // bar 是否在顶部
-    Client *clients; // 当前显示器的窗口，为单练表
+    unsigned int dirty; // 待 flush 处理的 Dirty* 标记
+    Client *clients, *ctail; // 当前显示器的窗口，为双链表
     Client *sel; // 当前聚焦的窗口
-    Client *stack; // 栈区窗口
+    Client *stack, *stail; // 栈区窗口
     Monitor *next; // 下一个显示器
     Window barwin; // bar 窗口，用于显示 bar
+    BarSeg seg[SegLast]; // bar 各段的缓存
+    Pixmap barpix;       // 整个 bar 的内容，expose 时直接复制
+    int segw;            // 段 pixmap 和 barpix 的宽度
     const Layout *lt[2]; // 保存两种布局
 };
 
@@ -167,6 +243,58 @@ typedef struct {
     Client *icons;
 } Systray;
 
+/* raw window property, data is in server format (32-bit items as returned by propitem) */
+typedef struct {
+    Atom type;
+    int format;
+    unsigned long n;        // 元素个数
+    unsigned char *data;
+    void *mem;              // 需释放的内存，预取的属性为 NULL
+} Prop;
+
+/* property requests issued together, replies are consumed on demand */
+typedef struct {
+    Window win;
+    int state[PropLast];    // 0 未请求，1 已发出请求，2 已收到回复
+    Prop prop[PropLast];
+#ifdef XCB
+    xcb_get_property_cookie_t cookie[PropLast];
+#endif /* XCB */
+} Prefetch;
+
+typedef struct Timer Timer;
+struct Timer {
+    void (*func)(void);
+    unsigned long expires; // 到期的 tick
+    int pending;
+    Timer *next;
+};
+
+/* named status block, set over the status socket */
+typedef struct {
+    char name[32];
+    char text[256];
+    char fg[8], bg[8];      // "#RRGGBB"
+    unsigned int fga, bga;
+    int x, w;               // 在状态段中的位置
+    int dirty;              // 内容变化，尚未绘制
+} Block;
+
+/* status producer connection, lines are buffered until complete */
+typedef struct {
+    int fd;
+    unsigned int len;
+    int discarding; /* rest of an overlong line, dropped up to its '\n' */
+    char buf[512];
+} StatusConn;
+
+/* Window -> object registry, open addressing with linear probing */
+typedef struct {
+    Window win;     // 0 表示空槽
+    int kind;
+    void *p;
+} WinEntry;
+
 /* function declarations */
 static void applyrules(Client *c);
 static int applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact);
@@ -176,13 +304,17 @@ static void attach(Client *c);
 static void attachbottom(Client *c);
 static void attachstack(Client *c);
 static void buttonpress(XEvent *e);
+static int blockcolors(Block *b, const char *s);
 static void checkotherwm(void);
 static void cleanup(void);
 static void cleanupmon(Monitor *mon);
 static void clientmessage(XEvent *e);
+static void compilestatus(void);
 static void configure(Client *c);
 static void configurenotify(XEvent *e);
+static void countclient(Client *c, int n);
 static void configurerequest(XEvent *e);
+static void canceltimer(Timer *t);
 static void correct(Monitor *m);
 static Monitor *createmon(void);
 static void destroynotify(XEvent *e);
@@ -190,32 +322,48 @@ static void detach(Client *c);
 static void detachstack(Client *c);
 static Monitor *dirtomon(int dir);
 static void drawbar(Monitor *m);
-static void drawbars(void);
-static int drawstatus(Monitor *m);
+static int drawblocks(int x);
+static void drawblock(Block *b, int x);
+static int drawstatus(int x);
+static void enterfocus(void);
 static void enternotify(XEvent *e);
 static void exectagnoc(void);
 static void expose(XEvent *e);
+static void flush(void);
 static void focus(Client *c);
+static void focusenter(Client *c, Monitor *m);
 static void focusin(XEvent *e);
 static void focusmon(const Arg *arg);
 static void focusstack(int inc, int hid);
 static void focusstackhid(const Arg *arg);
 static void focusstackvis(const Arg *arg);
+static void fontsready(void);
 static Atom getatomprop(Client *c, Atom prop);
+static int fetchprop(Window w, Atom atom, Prop *p);
+static int getclass(Window w, char *class, char *instance, unsigned int size);
+static int getprop(Window w, Atom atom, Prop *p);
 static int getrootptr(int *x, int *y);
 static long getstate(Window w);
 static unsigned int getsystraywidth(void);
 static int gettextprop(Window w, Atom atom, char *text, unsigned int size);
+static int gettransient(Window w, Window *trans);
+static int getwmhints(Window w, XWMHints *wmh);
+static int getsizehints(Window w, XSizeHints *size);
 static void grabbuttons(Client *c, int focused);
 static void grabkeys(void);
+static unsigned long hashint(unsigned long h, unsigned long v);
+static unsigned long hashstr(unsigned long h, const char *s);
 static void hide(Client *c);
 static void hideclient(const Arg *arg);
 static void grid(Monitor *m);
+static void handlesignal(void);
 static void gridplace(Client *clients, int x, int y, int w, int h, unsigned int gap, Client* (*next)(Client *c));
 static void incnmaster(const Arg *arg);
+static unsigned int keyrepeats(XKeyEvent *ev);
 static void keypress(XEvent *e);
 static void killclient(const Arg *arg);
 static void manage(Window w, XWindowAttributes *wa);
+static void markdirty(Monitor *m, unsigned int bits);
 static void mappingnotify(XEvent *e);
 static void maprequest(XEvent *e);
 static void motionnotify(XEvent *e);
@@ -225,8 +373,13 @@ static Client *nexttiled(Client *c);
 static void setfloatingxy(Client *c);
 static void pointertoclient(Client *c);
 static void pop(Client *c);
+static void prefetch(Prefetch *pf, Window w);
+static void prefetchfree(Prefetch *pf);
+static void propfree(Prop *p);
+static unsigned long propitem(Prop *p, unsigned long i);
 static void propertynotify(XEvent *e);
 static void quit(const Arg *arg);
+static int redrawblocks(Monitor *m, unsigned long h);
 static Monitor *recttomon(int x, int y, int w, int h);
 static void removesystrayicon(Client *i);
 static void resize(Client *c, int x, int y, int w, int h, int interact);
@@ -236,22 +389,32 @@ static void resizemouse(const Arg *arg);
 static void resizerequest(XEvent *e);
 static void restack(Monitor *m);
 static void run(void);
+static void runtimers(void);
 static void scan(void);
 static int sendevent(Window w, Atom proto, int m, long d0, long d1, long d2, long d3, long d4);
+static void segplace(Monitor *m, int seg, int x);
+static void segstore(Monitor *m, int seg, unsigned long hash, int x, int w);
 static void sendmon(Client *c, Monitor *m);
 static void setclientstate(Client *c, long state);
 static void setfocus(Client *c);
 static void setfullscreen(Client *c, int fullscreen);
 static void setlayout(const Arg *arg);
 static void setmfact(const Arg *arg);
+static void settimer(Timer *t, unsigned int ms);
 static void setup(void);
 static void seturgent(Client *c, int urg);
+static void setisurgent(Client *c, int urg);
 static void show(Client *c);
 static void showall(Monitor *m);
 static void showclient(const Arg *arg);
 static void showhide(Client *c);
-static void sigchld(int unused);
 static void spawn(const Arg *arg);
+static void statusaccept(void);
+static void statuschanged(void);
+static void statusline(char *line);
+static void statusopen(void);
+static void statusread(StatusConn *sc);
+static void statussample(void);
 static Monitor *systraytomon(Monitor *m);
 static void tag(const Arg *arg);
 static void tagmon(const Arg *arg);
@@ -270,7 +433,9 @@ static void updatebars(void);
 static void updateclientlist(void);
 static int updategeom(void);
 static void updatenumlockmask(void);
+static void updateprotocols(Client *c);
 static void updatesizehints(Client *c);
+static void updatestate(Client *c, XPropertyEvent *ev);
 static void updatestatus(void);
 static void updatesystray(void);
 static void updatesystrayicongeom(Client *i, int w, int h);
@@ -279,6 +444,10 @@ static void updatetitle(Client *c);
 static void updatewindowtype(Client *c);
 static void updatewmhints(Client *c);
 static void view(const Arg *arg);
+static Client *visclients(Monitor *m);
+static WinEntry *winlookup(Window w);
+static void winregister(Window w, int kind, void *p);
+static void winunregister(Window w);
 static Client *wintoclient(Window w);
 static Monitor *wintomon(Window w);
 static Client *wintosystrayicon(Window w);
@@ -293,13 +462,40 @@ static Clr *status_scm;
 static Systray *systray = NULL;
 static const char broken[] = "broken";
 static char stext[1024];
+static Block stextsegs[MAXBLOCKS]; /* stext split into colored segments by compilestatus */
+static int nstextsegs;
+static long long stextread;        /* ms, when stext was last read */
+static Block blocks[MAXBLOCKS]; /* take precedence over stext when any is set */
+static int nblocks;
+static int blockslayout;        /* blocks added or removed since the last full draw */
+static unsigned long blockshash;
+static Monitor *blocksmon;      /* monitor whose status segment holds all blocks */
+static int statusfd = -1;
+static int statuspipe = -1; /* lines from the status thread */
+static StatusConn statusconns[STATUSCONNS];
+static char statuspath[sizeof(((struct sockaddr_un *)0)->sun_path)];
 static int screen;
 static int sw, sh; /* X display screen geometry width, height */
 static int bh;     /* bar height */
 static int lrpad;  /* sum of left and right padding for text */
 static int (*xerrorxlib)(Display *, XErrorEvent *);
 static unsigned int numlockmask = 0;
+static unsigned int keyrepeat = 1; /* presses of the binding being run, merged by keypress() */
+static void (*const repeatable[])(const Arg *) = { focusstackvis, incnmaster, setmfact };
 static unsigned int overviewtags;
+static unsigned int dirty; /* DirtyClientList | DirtySystray | DirtyEnter */
+static Client *entertarget; /* pointer crossing not yet turned into focus */
+static Monitor *entermon;
+static int enterpending;
+static Window *clientlist[2]; /* last published _NET_CLIENT_LIST and _NET_CLIENT_LIST_STACKING */
+static unsigned int nclientlist[2];
+static int sigfd = -1, timerfd = -1;
+static sigset_t oldsigmask; /* restored in spawned children */
+static Timer *wheel[WHEELSIZE];
+static unsigned long ticks;
+static unsigned int ntimers;
+static Timer statustimer = { updatestatus };
+static Timer entertimer = { enterfocus };
 static void (*handler[LASTEvent])(XEvent *) = {
     [ButtonPress] = buttonpress,
     [ClientMessage] = clientmessage,
@@ -317,6 +513,11 @@ static void (*handler[LASTEvent])(XEvent *) = {
     [ResizeRequest] = resizerequest,
     [UnmapNotify] = unmapnotify};
 static Atom wmatom[WMLast], netatom[NetLast], xatom[XLast];
+static Atom propatom[PropLast];
+static Prefetch *prefetched; /* replies for the window being managed */
+#ifdef XCB
+static xcb_connection_t *xcon;
+#endif /* XCB */
 static int running = 1; // dwm 是否在运行，为 0 退出 dwm
 static Cur *cursor[CurLast];
 static Clr **scheme;
@@ -324,6 +525,8 @@ static Display *dpy;
 static Drw *drw;
 static Monitor *mons, *selmon;
 static Window root, wmcheckwin;
+static WinEntry *wintab;
+static unsigned int wintabsize, wintabused;
 
 static int useargb = 0;
 static Visual *visual;
@@ -338,23 +541,25 @@ struct NumTags {
     char limitexceeded[LENGTH(tags) > 31 ? -1 : 1];
 };
 
+/* key dispatch, rebuilt by grabkeys(): 1 + index of the first binding for a
+ * keycode and KEYMODS state, further bindings in the same slot are chained */
+static unsigned short keytab[256][128];
+static unsigned short keychain[LENGTH(keys)];
+
 /* function implementations */
 void
 applyrules(Client *c)
 {
-    const char *class, *instance;
+    char class[256], instance[256]; // X 窗口属性 WM_CLASS，有 name 和 class 两个值
     unsigned int i;
     const Rule *r;
     Monitor *m;
-    XClassHint ch = { NULL, NULL }; // X 窗口属性，有窗口 name 和 class 两个属性
 
     /* rule matching */
     c->isfloating = 0;
     c->tags = 0;
     c->isbottom = 0;
-    XGetClassHint(dpy, c->win, &ch);
-    class = ch.res_class ? ch.res_class : broken;
-    instance = ch.res_name ? ch.res_name : broken;
+    getclass(c->win, class, instance, sizeof class);
     // 应用 rules
     for (i = 0; i < LENGTH(rules); i++)
     {
@@ -371,11 +576,6 @@ applyrules(Client *c)
                 c->mon = m;
         }
     }
-    // 释放内存
-    if (ch.res_class)
-        XFree(ch.res_class);
-    if (ch.res_name)
-        XFree(ch.res_name);
     // 若未指定 tag 则将窗口放在当先显示器选中的 tag
     if (!(c->tags &= TAGMASK)) // 未指定 tag
     {
@@ -462,23 +662,11 @@ applysizehints(Client *c, int *x, int *y, int *w, int *h, int interact)
     return *x != c->x || *y != c->y || *w != c->w || *h != c->h;
 }
 
-// 显示显示器 m 选中 tag 的窗口，传递 NULL 为初始化
+// 显示显示器 m 选中 tag 的窗口，传递 NULL 为所有显示器，实际工作推迟到 flush
 void
 arrange(Monitor *m)
 {
-    if (m)
-        showhide(m->stack);
-    else    // 初始化
-        for (m = mons; m; m = m->next)
-            showhide(m->stack);
-    if (m)
-    {
-        arrangemon(m);
-        restack(m);
-    }
-    else
-        for (m = mons; m; m = m->next)
-            arrangemon(m);
+    markdirty(m, DirtyLayout);
 }
 
 // 当显示器的窗口改变时调用
@@ -487,7 +675,7 @@ arrangemon(Monitor *m)
 {
     strncpy(m->ltsymbol, m->lt[m->sellt]->symbol, sizeof m->ltsymbol);
     if (ISOVERVIEW(m))
-        gridplace(selmon->clients, selmon->wx + gapo, selmon->wy + gapo,
+        gridplace(visclients(selmon), selmon->wx + gapo, selmon->wy + gapo,
                   selmon->ww - 2 * gapo, selmon->wh - 2 * gapo, gapi, nextclient);
     else
         m->lt[m->sellt]->arrange(m);
@@ -497,24 +685,38 @@ arrangemon(Monitor *m)
 void
 attach(Client *c)
 {
+    c->prev = NULL;
     c->next = c->mon->clients;
+    if (c->next)
+        c->next->prev = c;
+    else
+        c->mon->ctail = c;
     c->mon->clients = c;
+    countclient(c, 1);
 }
 
 void
 attachbottom(Client *c)
 {
-    Client **tc;
-
-    for (tc = &c->mon->clients; *tc; tc = &(*tc)->next);
-    *tc = c;
     c->next = NULL;
+    c->prev = c->mon->ctail;
+    if (c->prev)
+        c->prev->next = c;
+    else
+        c->mon->clients = c;
+    c->mon->ctail = c;
+    countclient(c, 1);
 }
 
 // 将 c 连接在显示器 stack 的头部
 void attachstack(Client *c)
 {
+    c->sprev = NULL;
     c->snext = c->mon->stack;
+    if (c->snext)
+        c->snext->sprev = c;
+    else
+        c->mon->stail = c;
     c->mon->stack = c;
 }
 
@@ -523,7 +725,6 @@ void
 buttonpress(XEvent *e)
 {
     unsigned int i, x, click;
-    unsigned int occ = 0;
     Arg arg = {0};
     Client *c;
     Monitor *m;
@@ -541,11 +742,9 @@ buttonpress(XEvent *e)
     if (ev->window == selmon->barwin)
     {
         i = x = 0;
-        for(c = m->clients; c; c=c->next)
-            occ |= c->tags;
         do {
             /* Do not reserve space for vacant tags */
-            if (!(occ & 1 << i || m->tagset[m->seltags] & 1 << i))
+            if (!(m->occ & 1 << i || m->tagset[m->seltags] & 1 << i))
                 continue;
             x += TEXTW(tags[i]);
         } while (ev->x >= x && ++i < LENGTH(tags));
@@ -556,20 +755,13 @@ buttonpress(XEvent *e)
         }
         else if (ev->x < (x = x + TEXTW(selmon->ltsymbol)))
             click = ClkLtSymbol;
-        else if (ev->x > selmon->ww - (int)TEXTW(stext) - getsystraywidth())
+        else if (selmon->seg[SegStatus].w && ev->x >= selmon->seg[SegStatus].x)
             click = ClkStatusText;
         else
         {
-            if (m->bt == 0)
-                return;
-
-            c = m->clients;
-            do {
-                if (!ISVISIBLE(c))
-                    continue;
-                else
-                    x += c->taskw;
-            } while (ev->x > x && (c = c->next));
+            for (c = visclients(m); c; c = c->vnext)
+                if (ev->x <= (x += c->taskw))
+                    break;
 
             if (c) {
                 click = ClkWinTitle;
@@ -581,7 +773,7 @@ buttonpress(XEvent *e)
     else if ((c = wintoclient(ev->window)))
     {
         focus(c);
-        restack(selmon);
+        markdirty(selmon, DirtyStack);
         XAllowEvents(dpy, ReplayPointer, CurrentTime);
         click = ClkClientWin;
     }
@@ -629,6 +821,20 @@ cleanup(void)
         free(scheme[i]);
     free(scheme);
     XDestroyWindow(dpy, wmcheckwin);
+    free(wintab);
+    free(clientlist[0]);
+    free(clientlist[1]);
+    status_stop();
+    for (i = 0; i < STATUSCONNS; i++)
+        if (statusconns[i].fd >= 0)
+            close(statusconns[i].fd);
+    if (statusfd >= 0)
+    {
+        close(statusfd);
+        unlink(statuspath);
+    }
+    close(sigfd);
+    close(timerfd);
     drw_free(drw);
     XSync(dpy, False);
     XSetInputFocus(dpy, PointerRoot, RevertToPointerRoot, CurrentTime);
@@ -640,6 +846,7 @@ void
 cleanupmon(Monitor *mon)
 {
     Monitor *m;
+    int i;
 
     if (mon == mons)
         mons = mons->next;
@@ -648,8 +855,20 @@ cleanupmon(Monitor *mon)
         for (m = mons; m && m->next != mon; m = m->next);
         m->next = mon->next;
     }
+    if (entermon == mon)
+    {
+        enterpending = 0;
+        entertarget = NULL;
+        entermon = NULL;
+    }
+    winunregister(mon->barwin);
     XUnmapWindow(dpy, mon->barwin);
     XDestroyWindow(dpy, mon->barwin);
+    for (i = 0; i < SegLast; i++)
+        if (mon->seg[i].pix)
+            XFreePixmap(dpy, mon->seg[i].pix);
+    if (mon->barpix)
+        XFreePixmap(dpy, mon->barpix);
     free(mon);
 }
 
@@ -674,6 +893,7 @@ clientmessage(XEvent *e)
             c->mon = selmon;
             c->next = systray->icons;
             systray->icons = c;
+            winregister(c->win, WinSystrayIcon, c);
             if (!XGetWindowAttributes(dpy, c->win, &wa)) {
                 /* use sane defaults */
                 wa.width = bh;
@@ -703,9 +923,8 @@ clientmessage(XEvent *e)
             sendevent(c->win, netatom[Xembed], StructureNotifyMask, CurrentTime, XEMBED_FOCUS_IN, 0 , systray->win, XEMBED_EMBEDDED_VERSION);
             sendevent(c->win, netatom[Xembed], StructureNotifyMask, CurrentTime, XEMBED_WINDOW_ACTIVATE, 0 , systray->win, XEMBED_EMBEDDED_VERSION);
             sendevent(c->win, netatom[Xembed], StructureNotifyMask, CurrentTime, XEMBED_MODALITY_ON, 0 , systray->win, XEMBED_EMBEDDED_VERSION);
-            XSync(dpy, False);
             resizebarwin(selmon);
-            updatesystray();
+            markdirty(NULL, DirtySystray);
             setclientstate(c, NormalState);
         }
         return;
@@ -746,21 +965,42 @@ configure(Client *c)
     XSendEvent(dpy, c->win, False, StructureNotifyMask, (XEvent *)&ce);
 }
 
+// 将 c 计入 (n = 1) 或移出 (n = -1) 所在显示器的 tag 计数
+void
+countclient(Client *c, int n)
+{
+    Monitor *m = c->mon;
+    unsigned int i, t;
+
+    for (i = 0, t = c->tags; t; i++, t >>= 1)
+    {
+        if (!(t & 1))
+            continue;
+        m->tagcount[i] += n;
+        m->occ = m->tagcount[i] ? m->occ | 1 << i : m->occ & ~(1 << i);
+        if (!c->isurgent)
+            continue;
+        m->urgcount[i] += n;
+        m->urg = m->urgcount[i] ? m->urg | 1 << i : m->urg & ~(1 << i);
+    }
+    m->visdirty = 1;
+}
+
 void
 configurenotify(XEvent *e)
 {
     Monitor *m;
     Client *c;
     XConfigureEvent *ev = &e->xconfigure;
-    int dirty;
+    int resized;
 
     /* TODO: updategeom handling sucks, needs to be simplified */
     if (ev->window == root)
     {
-        dirty = (sw != ev->width || sh != ev->height);
+        resized = (sw != ev->width || sh != ev->height);
         sw = ev->width;
         sh = ev->height;
-        if (updategeom() || dirty)
+        if (updategeom() || resized)
         {
             drw_resize(drw, sw, bh);
             updatebars();
@@ -777,6 +1017,20 @@ configurenotify(XEvent *e)
     }
 }
 
+void
+canceltimer(Timer *t)
+{
+    Timer **tp;
+
+    if (!t->pending)
+        return;
+    for (tp = &wheel[t->expires % WHEELSIZE]; *tp != t; tp = &(*tp)->next);
+    *tp = t->next;
+    t->pending = 0;
+    if (--ntimers == 0) // 没有定时器时停止 timerfd，避免空转唤醒
+        timerfd_settime(timerfd, 0, &(struct itimerspec){0}, NULL);
+}
+
 void configurerequest(XEvent *e)
 {
     Client *c;
@@ -834,7 +1088,6 @@ void configurerequest(XEvent *e)
         wc.stack_mode = ev->detail;
         XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
     }
-    XSync(dpy, False);
 }
 
 // 更正显示器 m 的窗口状态（应该隐藏但显示的窗口状态更正）
@@ -880,26 +1133,37 @@ void destroynotify(XEvent *e)
     {
         removesystrayicon(c);
         resizebarwin(selmon);
-        updatesystray();
+        markdirty(NULL, DirtySystray);
     }
 }
 
 void detach(Client *c)
 {
-    Client **tc;
-
-    for (tc = &c->mon->clients; *tc && *tc != c; tc = &(*tc)->next)
-        ;
-    *tc = c->next;
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        c->mon->clients = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        c->mon->ctail = c->prev;
+    c->next = c->prev = NULL;
+    countclient(c, -1);
 }
 
 void detachstack(Client *c)
 {
-    Client **tc, *t;
+    Client *t;
 
-    for (tc = &c->mon->stack; *tc && *tc != c; tc = &(*tc)->snext)
-        ;
-    *tc = c->snext;
+    if (c->sprev)
+        c->sprev->snext = c->snext;
+    else
+        c->mon->stack = c->snext;
+    if (c->snext)
+        c->snext->sprev = c->sprev;
+    else
+        c->mon->stail = c->sprev;
+    c->snext = c->sprev = NULL;
 
     if (c == c->mon->sel)
     {
@@ -930,146 +1194,203 @@ dirtomon(int dir)
 
 void drawbar(Monitor *m)
 {
-    int x, w, scm, empty_w = m->ww - 2 * barpadh, systray_w = 0, status_w = 0;
-    unsigned int i, occ = 0, urg = 0;
+    int x, w, x0, x1, scm, empty_w, bar_w, systray_w = 0;
+    unsigned int i;
+    unsigned long h;
     Client *c;
 
     if (!m->showbar)
         return;
-    // 获取系统托盘宽度
+    // 获取系统托盘宽度，托盘是独立窗口，barwin 不包含这段空隙
     if(showsystray && m == systraytomon(m))
         systray_w = getsystraywidth();
-    empty_w -= systray_w;
-    // 首先绘制 status 以便后面可被覆盖
-    if (m == selmon) // status 只在选中显示器绘制
-        status_w = drawstatus(m);
+    bar_w = m->ww - systray_w - 2 * barpadh;
     resizebarwin(m);
+    drw->placeholder = 0;
+    if (m->segw != m->ww) // 宽度变化后重建各段 pixmap
+    {
+        if (m->barpix)
+            XFreePixmap(dpy, m->barpix);
+        m->barpix = XCreatePixmap(dpy, root, m->ww, bh, depth);
+        for (i = 0; i < SegLast; i++)
+        {
+            if (m->seg[i].pix)
+                XFreePixmap(dpy, m->seg[i].pix);
+            m->seg[i].pix = XCreatePixmap(dpy, root, m->ww, bh, depth);
+            m->seg[i].hash = 0;
+            m->seg[i].shown = 0;
+        }
+        m->segw = m->ww;
+    }
 
-    for (c = m->clients; c; c = c->next)
+    // status 只在选中显示器绘制，从右往左
+    // 有状态块时忽略 stext，块的宽度不变时只重绘变化的块
+    h = hashint(m != selmon ? FNV_OFFSET : nblocks ? blockshash : hashstr(FNV_OFFSET, stext), m == selmon);
+    if (h != m->seg[SegStatus].hash
+    && !(m == selmon && m == blocksmon && m->seg[SegStatus].hash && redrawblocks(m, h)))
     {
-        if (ISVISIBLE(c))
-            m->bt++;
-        occ |= c->tags;
-        if (c->isurgent)
-            urg |= c->tags;
+        if (blocksmon == m)
+            blocksmon = NULL;
+        if (m != selmon)
+            w = 0;
+        else if (nblocks)
+        {
+            w = drawblocks(bar_w);
+            blocksmon = m;
+        }
+        else
+            w = drawstatus(bar_w);
+        segstore(m, SegStatus, h, bar_w - w, w);
     }
+    segplace(m, SegStatus, bar_w - m->seg[SegStatus].w);
+
     // 绘制 tag
-    x = 0;
-    if (ISOVERVIEW(m))
+    h = hashint(hashint(hashint(hashint(FNV_OFFSET, ISOVERVIEW(m)), m->occ), m->urg), m->tagset[m->seltags]);
+    if (h != m->seg[SegTags].hash)
     {
-        w = TEXTW(overviewsymbol);
-        drw_setscheme(drw, scheme[SchemeSel]);
-        drw_text(drw, x, 0, w, bh, lrpad / 2, overviewsymbol, 0);
-        x += w;
-    }
-    else
-        for (i = 0; i < LENGTH(tags); i++)
+        x = 0;
+        if (ISOVERVIEW(m))
         {
-            if(!(occ & 1 << i || m->tagset[m->seltags] & 1 << i)) // 跳过空闲的(无窗口) tag
-                continue;
-            w = TEXTW(tags[i]);
-            drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSelTag : SchemeNormTag]);
-            drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], urg & 1 << i);
+            w = TEXTW(overviewsymbol);
+            drw_setscheme(drw, scheme[SchemeSel]);
+            drw_text(drw, x, 0, w, bh, lrpad / 2, overviewsymbol, 0);
             x += w;
         }
+        else
+            for (i = 0; i < LENGTH(tags); i++)
+            {
+                if(!(m->occ & 1 << i || m->tagset[m->seltags] & 1 << i)) // 跳过空闲的(无窗口) tag
+                    continue;
+                w = TEXTW(tags[i]);
+                drw_setscheme(drw, scheme[m->tagset[m->seltags] & 1 << i ? SchemeSelTag : SchemeNormTag]);
+                drw_text(drw, x, 0, w, bh, lrpad / 2, tags[i], m->urg & 1 << i);
+                x += w;
+            }
+        segstore(m, SegTags, h, 0, x);
+    }
+    segplace(m, SegTags, 0);
+    x = m->seg[SegTags].w;
+
     // 绘制 layout
-    w = TEXTW(m->ltsymbol);
-    drw_setscheme(drw, scheme[SchemeNorm]);
-    x = drw_text(drw, x, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
-    // 绘制 title
-    empty_w = empty_w - status_w - x;
-    for (c = m->clients; c; c = c->next)
+    h = hashstr(FNV_OFFSET, m->ltsymbol);
+    if (h != m->seg[SegLayout].hash)
     {
-        if (!ISVISIBLE(c))
-            continue;
-        if (m->sel == c)
-            scm = SchemeSel;
-        else if (c->ishide)
-            scm = SchemeHid;
-        else
-            scm = SchemeNorm;
-        drw_setscheme(drw, scheme[scm]);
-        w = MIN(TEXTW(c->name), TEXTW("        "));
-        if (w > empty_w)
+        w = TEXTW(m->ltsymbol);
+        drw_setscheme(drw, scheme[SchemeNorm]);
+        w = drw_text(drw, 0, 0, w, bh, lrpad / 2, m->ltsymbol, 0);
+        segstore(m, SegLayout, h, 0, w);
+    }
+    segplace(m, SegLayout, x);
+    x += m->seg[SegLayout].w;
+
+    // 绘制 title，剩余宽度由 filler 填充
+    empty_w = MAX(bar_w - m->seg[SegStatus].w - x, 0);
+    h = hashint(hashint(FNV_OFFSET, empty_w), (unsigned long)m->sel);
+    for (c = visclients(m); c; c = c->vnext)
+        h = hashint(hashint(hashstr(hashint(h, (unsigned long)c), c->name), c->ishide), c->isfloating);
+    if (h != m->seg[SegTasks].hash)
+    {
+        w = empty_w;
+        for (x = 0, c = visclients(m); c; c = c->vnext)
         {
-            w = empty_w;
-            drw_text(drw, x, 0, w, bh, lrpad / 2, "...", 0);
-            c->taskw = w;
-            break;
+            if (m->sel == c)
+                scm = SchemeSel;
+            else if (c->ishide)
+                scm = SchemeHid;
+            else
+                scm = SchemeNorm;
+            drw_setscheme(drw, scheme[scm]);
+            w = MIN(TEXTW(c->name), TEXTW("        "));
+            if (w > empty_w)
+            {
+                w = empty_w;
+                drw_text(drw, x, 0, w, bh, lrpad / 2, "...", 0);
+                c->taskw = w;
+                break;
+            }
+            else
+            {
+                drw_text(drw, x, 0, w, bh, lrpad / 2, c->name, 0);
+                if (c->isfloating)
+                    drw_rect(drw, x, 0, 7, 7, 0, 0);
+                x += w;
+                c->taskw = w;
+            }
+            empty_w -= w; // 剩余宽度
         }
-        else
+        if (empty_w > 0) // 填充剩余宽度
         {
-            drw_text(drw, x, 0, w, bh, lrpad / 2, c->name, 0);
-            if (c->isfloating)
-                drw_rect(drw, x, 0, 7, 7, 0, 0);
-            x += w;
-            c->taskw = w;
+            drw_setscheme(drw, scheme[SchemeBarEmpty]);
+            drw_rect(drw, x, 0, empty_w, bh, 1, 1);
         }
-        empty_w -= w; // 剩余宽度
+        segstore(m, SegTasks, h, 0, x + MAX(empty_w, 0));
     }
-    if (empty_w > 0) // 填充剩余宽度
+    segplace(m, SegTasks, m->seg[SegTags].w + m->seg[SegLayout].w);
+
+    // 只把内容或位置变化了的段合成到 barpix，段内局部重绘的只合成变化部分，
+    // 再把变化的范围一次复制到 barwin
+    x0 = m->ww, x1 = 0;
+    for (i = 0; i < SegLast; i++)
     {
-        drw_setscheme(drw, scheme[SchemeBarEmpty]);
-        drw_rect(drw, x, 0, empty_w, bh, 1, 1);
+        if (!m->seg[i].w)
+            continue;
+        if (!m->seg[i].shown)
+            x = 0, w = m->seg[i].w;
+        else if (m->seg[i].dw)
+            x = m->seg[i].dx, w = m->seg[i].dw;
+        else
+            continue;
+        XCopyArea(dpy, m->seg[i].pix, m->barpix, drw->gc, x, 0, w, bh, m->seg[i].x + x, 0);
+        x0 = MIN(x0, m->seg[i].x + x);
+        x1 = MAX(x1, m->seg[i].x + x + w);
+        m->seg[i].shown = 1;
+        m->seg[i].dw = 0;
     }
-    drw_map(drw, m->barwin, 0, 0, m->ww - systray_w - 2 * barpadh, bh);
+    if (x1 > x0)
+        XCopyArea(dpy, m->barpix, m->barwin, drw->gc, x0, 0, x1 - x0, bh, x0, 0);
 }
 
-void drawbars(void)
+// 从 x 处向左绘制所有状态块，记录各块在段内的位置，返回绘制的宽度
+int
+drawblocks(int x)
 {
-    Monitor *m;
+    int i, w = 0;
 
-    for (m = mons; m; m = m->next)
-        drawbar(m);
+    for (i = 0; i < nblocks; i++)
+    {
+        blocks[i].x = w;
+        blocks[i].w = TEXTW(blocks[i].text) - lrpad;
+        w += blocks[i].w;
+    }
+    for (i = 0; i < nblocks; i++)
+    {
+        drawblock(&blocks[i], x - w + blocks[i].x);
+        blocks[i].dirty = 0;
+    }
+    blockslayout = 0;
+    return w;
 }
 
-int
-drawstatus(Monitor *m)
+void
+drawblock(Block *b, int x)
 {
-    int status_w = 0,
-        system_w = 0,
-        x, w, start, end, count;
-    unsigned int alpha;
-    char buf8[8] = { [7] = 0 }, buf5[5] = { [4] = 0 },
-         text[64];
+    drw_clr_get(drw, &status_scm[ColFg], b->fg, b->fga);
+    drw_clr_get(drw, &status_scm[ColBg], b->bg, b->bga);
+    drw_setscheme(drw, status_scm);
+    drw_text(drw, x, 0, b->w, bh, 0, b->text, 0);
+}
 
-    if (showsystray && m == systraytomon(m))
-        system_w = getsystraywidth();
+// 从 x 处向左绘制 stext 的各段，返回绘制的宽度
+int
+drawstatus(int x)
+{
+    int i, w = 0;
 
-    // 从后往前绘制
-    x = m->ww - system_w - 2 * barpadh;
-    end = strlen(stext);
-    while (end > 0)
-    {
-        count = 0;
-        for (start = end - 1; start >= 0; start--)
-        {
-            if (stext[start] == '#')
-                count++;
-            if (count == 2)
-                break;
-        }
-        if (count == 2)
-        {
-            strncpy(buf8, stext+start, 7);
-            strncpy(buf5, stext+start+7, 4);
-            sscanf(buf5, "%x", &alpha);
-            drw_clr_create(drw, &status_scm[ColFg], buf8, alpha);
-            strncpy(buf8, stext+start+11, 7);
-            strncpy(buf5, stext+start+18, 4);
-            sscanf(buf5, "%x", &alpha);
-            drw_clr_create(drw, &status_scm[ColBg], buf8, alpha);
-            strncpy(text, stext+start+22, end-start-22), text[end-start-22] = 0;
-            // 开始绘制
-            drw_setscheme(drw, status_scm);
-            w = TEXTW(text) - lrpad;
-            x -= w;
-            drw_text(drw, x, 0, w, bh, 0, text, 0);
-            status_w += w;
-        }
-        end = start;
-    }
-    return status_w;
+    for (i = 0; i < nstextsegs; i++)
+        w += stextsegs[i].w;
+    for (i = 0, x -= w; i < nstextsegs; x += stextsegs[i].w, i++)
+        drawblock(&stextsegs[i], x);
+    return w;
 }
 
 void enternotify(XEvent *e)
@@ -1082,6 +1403,34 @@ void enternotify(XEvent *e)
         return;
     c = wintoclient(ev->window);
     m = c ? c->mon : wintomon(ev->window);
+    if (focusdwell < 0)
+    {
+        focusenter(c, m);
+        return;
+    }
+    // 只记下最后一次进入的窗口，指针停留 focusdwell 毫秒或本批事件处理完后再聚焦
+    entertarget = c;
+    entermon = m;
+    enterpending = 1;
+    if (focusdwell > 0)
+        settimer(&entertimer, focusdwell);
+    else
+        dirty |= DirtyEnter;
+}
+
+// 聚焦最后一次进入的窗口
+void
+enterfocus(void)
+{
+    if (!enterpending)
+        return;
+    enterpending = 0;
+    focusenter(entertarget, entertarget ? entertarget->mon : entermon);
+}
+
+void
+focusenter(Client *c, Monitor *m)
+{
     if (m != selmon)
     {
         unfocus(selmon->sel, 1);
@@ -1097,18 +1446,77 @@ void expose(XEvent *e)
     Monitor *m;
     XExposeEvent *ev = &e->xexpose;
 
-    if (ev->count == 0 && (m = wintomon(ev->window)))
+    if (!(m = wintomon(ev->window)) || ev->window != m->barwin)
+        return;
+    // bar 的内容保留在 barpix 中，只复制暴露的区域，不重绘也不碰托盘
+    if (m->segw == m->ww)
+        XCopyArea(dpy, m->barpix, m->barwin, drw->gc, ev->x, ev->y, ev->width, ev->height, ev->x, ev->y);
+    else
+        markdirty(m, DirtyBar);
+}
+
+// 执行本批事件累积的延迟工作，每个显示器的布局、堆叠和 bar 至多各处理一次
+void
+flush(void)
+{
+    Monitor *m;
+
+    if (dirty & DirtyEnter) // 先聚焦，本批的布局和 bar 一并反映
+        enterfocus();
+    for (m = mons; m; m = m->next)
     {
-        drawbar(m);
-        if (m == selmon)
-            updatesystray();
+        if (m->dirty & DirtyLayout)
+        {
+            showhide(m->stack);
+            arrangemon(m);
+            m->dirty |= DirtyStack;
+        }
+        if (m->dirty & DirtyPointer)
+            pointertoclient(m->sel);
+        if (m->dirty & DirtyStack)
+        {
+            restack(m);
+            m->dirty |= DirtyBar;
+            dirty |= DirtyClientList; /* stacking order */
+        }
+        if (m->dirty & DirtyBar)
+            drawbar(m);
+        m->dirty = 0;
     }
+    if (dirty & DirtySystray)
+        updatesystray();
+    if (dirty & DirtyClientList)
+        updateclientlist();
+    dirty = 0;
+}
+
+// 后备字体匹配完成，重绘用占位字形绘制过的段
+void
+fontsready(void)
+{
+    int i;
+    Monitor *m;
+
+    if (!drw_fallback_collect(drw))
+        return;
+    for (i = 0; i < nstextsegs; i++) // 字宽可能随新字体变化
+        stextsegs[i].w = TEXTW(stextsegs[i].text) - lrpad;
+    for (m = mons; m; m = m->next)
+        for (i = 0; i < SegLast; i++)
+            if (m->seg[i].stale)
+            {
+                m->seg[i].hash = 0;
+                markdirty(m, DirtyBar);
+            }
 }
 
 // 聚焦窗口 c，传递 NULL 自动聚焦
 void
 focus(Client *c)
 {
+    // 显式聚焦优先于尚未生效的指针进入
+    enterpending = 0;
+    canceltimer(&entertimer);
     if (!c || !ISVISIBLE(c) || HIDDEN(c))
         for (c = selmon->stack; c && (!ISVISIBLE(c) || HIDDEN(c)); c = c->snext);
     if (selmon->sel && selmon->sel != c)
@@ -1139,7 +1547,26 @@ focus(Client *c)
         XDeleteProperty(dpy, root, netatom[NetActiveWindow]);
     }
     selmon->sel = c;
-    drawbars();
+    markdirty(NULL, DirtyBar);
+}
+
+void
+handlesignal(void)
+{
+    struct signalfd_siginfo si;
+
+    while (read(sigfd, &si, sizeof si) == sizeof si)
+    {
+        switch (si.ssi_signo)
+        {
+        case SIGCHLD:
+            while (0 < waitpid(-1, NULL, WNOHANG));
+            break;
+        default: /* SIGTERM, SIGHUP */
+            running = 0;
+            break;
+        }
+    }
 }
 
 /* there are some broken focus acquiring clients needing extra handling */
@@ -1162,7 +1589,7 @@ void focusmon(const Arg *arg)
     unfocus(selmon->sel, 0);
     selmon = m;
     focus(NULL);
-    pointertoclient(selmon->sel);
+    markdirty(selmon, DirtyPointer);
 }
 
 void
@@ -1174,63 +1601,67 @@ focusstackhid(const Arg *arg)
 void
 focusstackvis(const Arg *arg)
 {
-    focusstack(arg->i, 0);
+    focusstack(arg->i * (int)keyrepeat, 0);
 }
 
 void focusstack(int inc, int hid)
 {
-    Client *c = NULL, *i;
+    Client *c = NULL, *s;
+    int n;
     // 如果窗口全部被隐藏或者选中窗口是全屏则直接返回
     if ((!selmon->sel && !hid) || (selmon->sel && selmon->sel->isfullscreen && lockfullscreen))
         return;
     // 如果选中显示器没开任何窗口则直接返回
     if (!selmon->clients)
         return;
-    if (inc > 0)
+    visclients(selmon);
+    // 每步从上一步选中的窗口出发，合并的按键重复一次走完
+    for (s = selmon->sel, n = abs(inc); n-- > 0; s = c)
     {
-        if (selmon->sel)
+        c = NULL;
+        if (inc > 0)
         {
-            for (c = selmon->sel->next;
-                 c && (!ISVISIBLE(c) || (hid ^ HIDDEN(c)));
-                 c = c->next);
+            if (s && ISVISIBLE(s))
+            {
+                for (c = s->vnext;
+                     c && (hid ^ HIDDEN(c));
+                     c = c->vnext);
+            }
+            if (!c)
+                for (c = selmon->vis;
+                     c && (hid ^ HIDDEN(c));
+                     c = c->vnext);
         }
-        if (!c)
-            for (c = selmon->clients;
-                 c && (!ISVISIBLE(c) || (hid ^ HIDDEN(c)));
-                 c = c->next);
-    }
-    else
-    {
-        if (selmon->sel)
+        else
         {
-            for (i = selmon->clients; i != selmon->sel; i = i->next)
-                if (ISVISIBLE(i) && !(hid ^ HIDDEN(i)))
-                    c = i;
+            if (s && ISVISIBLE(s))
+            {
+                for (c = s->vprev;
+                     c && (hid ^ HIDDEN(c));
+                     c = c->vprev);
+            }
+            if (!c)
+                for (c = selmon->vtail;
+                     c && (hid ^ HIDDEN(c));
+                     c = c->vprev);
         }
-        else
-            c = selmon->clients;
         if (!c)
-            for (; i; i = i->next)
-                if (ISVISIBLE(i) && !(hid ^ HIDDEN(i)))
-                    c = i;
+            break;
     }
     if (c)
     {
         if (c->ishide)
             show(c);
         focus(c);
-        pointertoclient(c);
-        arrangemon(selmon);
-        restack(selmon);
+        markdirty(selmon, DirtyPointer);
+        arrange(selmon);
     }
 }
 
 Atom getatomprop(Client *c, Atom prop)
 {
-    int di;
-    unsigned long dl;
-    unsigned char *p = NULL;
-    Atom da, atom = None;
+    Prop p;
+    Atom atom = None;
 
     /* FIXME getatomprop should return the number of items and a pointer to
      * the stored data instead of this workaround */
@@ -1238,18 +1669,104 @@ Atom getatomprop(Client *c, Atom prop)
     if (prop == xatom[XembedInfo])
         req = xatom[XembedInfo];
 
-    if (XGetWindowProperty(dpy, c->win, prop, 0L, sizeof atom, False, req,
-                           &da, &di, &dl, &dl, &p) == Success &&
-        p)
+    if (getprop(c->win, prop, &p) && p.type == req && p.format == 32 && p.n > 0)
     {
-        atom = *(Atom *)p;
-        if (da == xatom[XembedInfo] && dl == 2)
-            atom = ((Atom *)p)[1];
-        XFree(p);
+        atom = propitem(&p, 0);
+        if (p.type == xatom[XembedInfo] && p.n == 2)
+            atom = propitem(&p, 1);
     }
+    propfree(&p);
     return atom;
 }
 
+// 读取 WM_CLASS，缺失的值置为 broken
+int getclass(Window w, char *class, char *instance, unsigned int size)
+{
+    Prop p;
+    unsigned long i, n = 0;
+
+    strcpy(class, broken);
+    strcpy(instance, broken);
+    if (getprop(w, wmatom[WMClass], &p) && p.type == XA_STRING && p.format == 8)
+    {
+        /* "instance\0class\0" */
+        for (n = 0; n < p.n && p.data[n]; n++);
+        if (n)
+            snprintf(instance, size, "%.*s", (int)n, (char *)p.data);
+        for (i = ++n; i < p.n && p.data[i]; i++);
+        if (i > n)
+            snprintf(class, size, "%.*s", (int)(i - n), (char *)p.data + n);
+    }
+    propfree(&p);
+    return n > 0;
+}
+
+int fetchprop(Window w, Atom atom, Prop *p)
+{
+#ifdef XCB
+    xcb_get_property_reply_t *r;
+
+    memset(p, 0, sizeof(Prop));
+    ROUNDTRIP();
+    if (!(r = xcb_get_property_reply(xcon,
+                  xcb_get_property(xcon, 0, w, atom, XCB_GET_PROPERTY_TYPE_ANY, 0, PROPLEN), NULL)))
+        return 0;
+    p->mem = r;
+    p->type = r->type;
+    p->format = r->format;
+    p->n = r->value_len;
+    p->data = xcb_get_property_value(r);
+#else
+    unsigned long extra;
+
+    memset(p, 0, sizeof(Prop));
+    if (XGetWindowProperty(dpy, w, atom, 0L, PROPLEN, False, AnyPropertyType,
+                           &p->type, &p->format, &p->n, &extra, &p->data) != Success)
+        return 0;
+    p->mem = p->data;
+#endif /* XCB */
+    return p->type != None;
+}
+
+// 读取属性，manage 预取过的直接使用回复，否则同步请求
+int getprop(Window w, Atom atom, Prop *p)
+{
+    int i;
+#ifdef XCB
+    xcb_get_property_reply_t *r;
+#endif /* XCB */
+
+    for (i = 0; prefetched && prefetched->win == w && i < PropLast; i++)
+    {
+        if (propatom[i] != atom)
+            continue;
+#ifdef XCB
+        if (prefetched->state[i] == 1)
+        {
+            if ((r = xcb_get_property_reply(xcon, prefetched->cookie[i], NULL)))
+            {
+                prefetched->prop[i].mem = r;
+                prefetched->prop[i].type = r->type;
+                prefetched->prop[i].format = r->format;
+                prefetched->prop[i].n = r->value_len;
+                prefetched->prop[i].data = xcb_get_property_value(r);
+            }
+            prefetched->state[i] = 2;
+        }
+#endif /* XCB */
+        if (prefetched->state[i] == 0)
+        {
+            /* not requested ahead, fetch it once and keep it */
+            fetchprop(w, atom, &prefetched->prop[i]);
+            prefetched->state[i] = 2;
+        }
+        *p = prefetched->prop[i];
+        p->mem = NULL;
+        return p->type != None;
+    }
+    return fetchprop(w, atom, p);
+}
+
 int getrootptr(int *x, int *y)
 {
     int di;
@@ -1261,18 +1778,12 @@ int getrootptr(int *x, int *y)
 
 long getstate(Window w)
 {
-    int format;
+    Prop p;
     long result = -1;
-    unsigned char *p = NULL;
-    unsigned long n, extra;
-    Atom real;
-
-    if (XGetWindowProperty(dpy, w, wmatom[WMState], 0L, 2L, False, wmatom[WMState],
-                           &real, &format, &n, &extra, (unsigned char **)&p) != Success)
-        return -1;
-    if (n != 0)
-        result = *p;
-    XFree(p);
+
+    if (getprop(w, wmatom[WMState], &p) && p.type == wmatom[WMState] && p.format == 32 && p.n)
+        result = propitem(&p, 0);
+    propfree(&p);
     return result;
 }
 
@@ -1290,16 +1801,25 @@ int gettextprop(Window w, Atom atom, char *text, unsigned int size)
 {
     char **list = NULL;
     int n;
+    Prop p;
     XTextProperty name;
 
     if (!text || size == 0)
         return 0;
     text[0] = '\0';
-    if (!XGetTextProperty(dpy, w, &name, atom) || !name.nitems)
+    if (!getprop(w, atom, &p) || !p.n || p.format != 8)
+    {
+        propfree(&p);
         return 0;
+    }
+    name.value = p.data;
+    name.encoding = p.type;
+    name.format = p.format;
+    name.nitems = p.n;
     if (name.encoding == XA_STRING)
     {
-        strncpy(text, (char *)name.value, size - 1);
+        /* replies are not NUL terminated */
+        snprintf(text, size, "%.*s", (int)MIN(name.nitems, size - 1), (char *)name.value);
     }
     else if (XmbTextPropertyToTextList(dpy, &name, &list, &n) >= Success && n > 0 && *list)
     {
@@ -1307,13 +1827,106 @@ int gettextprop(Window w, Atom atom, char *text, unsigned int size)
         XFreeStringList(list);
     }
     text[size - 1] = '\0';
-    XFree(name.value);
+    propfree(&p);
     return 1;
 }
 
+int gettransient(Window w, Window *trans)
+{
+    Prop p;
+    int ret = 0;
+
+    if (getprop(w, XA_WM_TRANSIENT_FOR, &p) && p.type == XA_WINDOW && p.format == 32 && p.n)
+    {
+        *trans = propitem(&p, 0);
+        ret = 1;
+    }
+    propfree(&p);
+    return ret;
+}
+
+// 解析 WM_HINTS，与 XGetWMHints 相同
+int getwmhints(Window w, XWMHints *wmh)
+{
+    Prop p;
+    int ret = 0;
+
+    if (getprop(w, XA_WM_HINTS, &p) && p.type == XA_WM_HINTS && p.format == 32 && p.n >= 8)
+    {
+        wmh->flags = propitem(&p, 0);
+        wmh->input = propitem(&p, 1) ? True : False;
+        wmh->initial_state = propitem(&p, 2);
+        wmh->icon_pixmap = propitem(&p, 3);
+        wmh->icon_window = propitem(&p, 4);
+        wmh->icon_x = (int)propitem(&p, 5);
+        wmh->icon_y = (int)propitem(&p, 6);
+        wmh->icon_mask = propitem(&p, 7);
+        wmh->window_group = p.n >= 9 ? propitem(&p, 8) : 0;
+        ret = 1;
+    }
+    propfree(&p);
+    return ret;
+}
+
+// 解析 WM_NORMAL_HINTS，与 XGetWMNormalHints 相同
+int getsizehints(Window w, XSizeHints *size)
+{
+    Prop p;
+    int ret = 0;
+
+    memset(size, 0, sizeof(XSizeHints));
+    if (getprop(w, XA_WM_NORMAL_HINTS, &p) && p.type == XA_WM_SIZE_HINTS && p.format == 32 && p.n >= 15)
+    {
+        size->flags = propitem(&p, 0) & (USPosition | USSize | PAllHints);
+        size->x = (int)propitem(&p, 1);
+        size->y = (int)propitem(&p, 2);
+        size->width = (int)propitem(&p, 3);
+        size->height = (int)propitem(&p, 4);
+        size->min_width = (int)propitem(&p, 5);
+        size->min_height = (int)propitem(&p, 6);
+        size->max_width = (int)propitem(&p, 7);
+        size->max_height = (int)propitem(&p, 8);
+        size->width_inc = (int)propitem(&p, 9);
+        size->height_inc = (int)propitem(&p, 10);
+        size->min_aspect.x = (int)propitem(&p, 11);
+        size->min_aspect.y = (int)propitem(&p, 12);
+        size->max_aspect.x = (int)propitem(&p, 13);
+        size->max_aspect.y = (int)propitem(&p, 14);
+        if (p.n >= 18)
+        {
+            size->flags |= propitem(&p, 0) & (PBaseSize | PWinGravity);
+            size->base_width = (int)propitem(&p, 15);
+            size->base_height = (int)propitem(&p, 16);
+            size->win_gravity = (int)propitem(&p, 17);
+        }
+        ret = 1;
+    }
+    propfree(&p);
+    return ret;
+}
+
+// FNV-1a，用于 bar 各段的内容哈希
+unsigned long hashint(unsigned long h, unsigned long v)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof v; i++, v >>= 8)
+        h = (h ^ (v & 0xff)) * FNV_PRIME;
+    return h;
+}
+
+unsigned long hashstr(unsigned long h, const char *s)
+{
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * FNV_PRIME;
+    return h;
+}
+
 void grabbuttons(Client *c, int focused)
 {
-    updatenumlockmask();
+    if (c->grabbed == focused) // 抓取状态未变，不发送任何请求
+        return;
+    c->grabbed = focused;
     {
         unsigned int i, j;
         unsigned int modifiers[] = {0, LockMask, numlockmask, numlockmask | LockMask};
@@ -1333,19 +1946,27 @@ void grabbuttons(Client *c, int focused)
 
 void grabkeys(void)
 {
-    updatenumlockmask();
-    {
-        unsigned int i, j;
-        unsigned int modifiers[] = {0, LockMask, numlockmask, numlockmask | LockMask};
-        KeyCode code;
+    unsigned int i, j;
+    unsigned int modifiers[] = {0, LockMask, numlockmask, numlockmask | LockMask};
+    KeyCode code;
+
+    // 按抓取的 keycode 和修饰键建表，与按下时取第 0 级 keysym 比较的结果一致，
+    // 同一格的绑定按 keys 中的顺序链接
+    memset(keytab, 0, sizeof keytab);
+    for (i = LENGTH(keys); i-- > 0; )
+        if ((code = XKeysymToKeycode(dpy, keys[i].keysym))
+        && XkbKeycodeToKeysym(dpy, code, 0, 0) == keys[i].keysym)
+        {
+            keychain[i] = keytab[code][KEYMODS(keys[i].mod)];
+            keytab[code][KEYMODS(keys[i].mod)] = i + 1;
+        }
 
-        XUngrabKey(dpy, AnyKey, AnyModifier, root);
-        for (i = 0; i < LENGTH(keys); i++)
-            if ((code = XKeysymToKeycode(dpy, keys[i].keysym)))
-                for (j = 0; j < LENGTH(modifiers); j++)
-                    XGrabKey(dpy, code, keys[i].mod | modifiers[j], root,
-                             True, GrabModeAsync, GrabModeAsync);
-    }
+    XUngrabKey(dpy, AnyKey, AnyModifier, root);
+    for (i = 0; i < LENGTH(keys); i++)
+        if ((code = XKeysymToKeycode(dpy, keys[i].keysym)))
+            for (j = 0; j < LENGTH(modifiers); j++)
+                XGrabKey(dpy, code, keys[i].mod | modifiers[j], root,
+                         True, GrabModeAsync, GrabModeAsync);
 }
 
 // 隐藏窗口但不改变 ishide 值，需自己调用后改变
@@ -1380,13 +2001,13 @@ hideclient(const Arg *arg)
     hide(selmon->sel);
     selmon->sel->ishide = 1;
     focus(NULL);
-    arrangemon(selmon);
+    arrange(selmon);
 }
 
 void incnmaster(const Arg *arg)
 {
-    selmon->nmaster = MAX(selmon->nmaster + arg->i, 0);
-    arrangemon(selmon);
+    selmon->nmaster = MAX(selmon->nmaster + arg->i * (int)keyrepeat, 0);
+    arrange(selmon);
 }
 
 #ifdef XINERAMA
@@ -1400,17 +2021,46 @@ isuniquegeom(XineramaScreenInfo *unique, size_t n, XineramaScreenInfo *info)
 }
 #endif /* XINERAMA */
 
+// 取出队列头部紧随的同一按键的自动重复，返回其中 KeyPress 的个数
+unsigned int
+keyrepeats(XKeyEvent *ev)
+{
+    XEvent next;
+    unsigned int n = 0;
+
+    while (XEventsQueued(dpy, QueuedAfterReading))
+    {
+        XPeekEvent(dpy, &next);
+        if ((next.type != KeyPress && next.type != KeyRelease) || next.xkey.keycode != ev->keycode
+        || (next.type == KeyPress && KEYMODS(next.xkey.state) != KEYMODS(ev->state)))
+            break;
+        XNextEvent(dpy, &next);
+        n += next.type == KeyPress;
+    }
+    return n;
+}
+
 void keypress(XEvent *e)
 {
-    unsigned int i;
-    KeySym keysym;
-    XKeyEvent *ev;
+    unsigned int i, j;
+    XKeyEvent *ev = &e->xkey;
 
-    ev = &e->xkey;
-    keysym = XKeycodeToKeysym(dpy, (KeyCode)ev->keycode, 0);
-    for (i = 0; i < LENGTH(keys); i++)
-        if (keysym == keys[i].keysym && CLEANMASK(keys[i].mod) == CLEANMASK(ev->state) && keys[i].func)
-            keys[i].func(&(keys[i].arg));
+    if (ev->keycode >= LENGTH(keytab))
+        return;
+    i = keytab[ev->keycode][KEYMODS(ev->state)];
+    // 可累加的绑定独占这个按键时，已排队的重复合并为一次调用，由函数按 keyrepeat 累加
+    if (i && !keychain[i - 1])
+        for (j = 0; j < LENGTH(repeatable); j++)
+            if (keys[i - 1].func == repeatable[j])
+            {
+                keyrepeat = 1 + keyrepeats(ev);
+                keys[i - 1].func(&(keys[i - 1].arg));
+                keyrepeat = 1;
+                return;
+            }
+    for (; i; i = keychain[i - 1])
+        if (keys[i - 1].func)
+            keys[i - 1].func(&(keys[i - 1].arg));
 }
 
 void killclient(const Arg *arg)
@@ -1428,6 +2078,20 @@ void killclient(const Arg *arg)
         XUngrabServer(dpy);
     }
 }
+// 记录需要延迟处理的工作，在本批事件处理完后由 flush 统一执行，m 为 NULL 时标记所有显示器
+void
+markdirty(Monitor *m, unsigned int bits)
+{
+    dirty |= bits & (DirtyClientList | DirtySystray);
+    if (!(bits &= ~(DirtyClientList | DirtySystray)))
+        return;
+    if (m)
+        m->dirty |= bits;
+    else
+        for (m = mons; m; m = m->next)
+            m->dirty |= bits;
+}
+
 // 生成 Client
 void
 manage(Window w, XWindowAttributes *wa)
@@ -1435,10 +2099,20 @@ manage(Window w, XWindowAttributes *wa)
     Client *c, *t = NULL;
     Window trans = None;
     XWindowChanges wc;
+    Prefetch pf, *own = NULL;
 
+    /* ask for every property up front, the getters below then only wait
+     * for replies that are already on their way */
+    if (!prefetched || prefetched->win != w)
+    {
+        prefetch(&pf, w);
+        prefetched = own = &pf;
+        ROUNDTRIP(); /* all replies arrive within one round trip */
+    }
     c = ecalloc(1, sizeof(Client));
     c->win = w;
     c->ishide = 0;
+    c->grabbed = -1;
     // 初始化位置大小
     c->x = c->oldx = wa->x;
     c->y = c->oldy = wa->y;
@@ -1447,7 +2121,7 @@ manage(Window w, XWindowAttributes *wa)
     c->oldbw = wa->border_width;
 
     updatetitle(c);
-    if (XGetTransientForHint(dpy, w, &trans) && (t = wintoclient(trans)))
+    if (gettransient(w, &trans) && (t = wintoclient(trans)))
     {
         c->mon = t->mon;
         c->tags = t->tags;
@@ -1473,6 +2147,12 @@ manage(Window w, XWindowAttributes *wa)
     updatewindowtype(c);
     updatesizehints(c);
     updatewmhints(c);
+    updateprotocols(c);
+    if (own)
+    {
+        prefetchfree(own);
+        prefetched = NULL;
+    }
     XSelectInput(dpy, w, EnterWindowMask | FocusChangeMask | PropertyChangeMask | StructureNotifyMask);
     grabbuttons(c, 0);
     if (!c->isfloating)
@@ -1492,8 +2172,8 @@ manage(Window w, XWindowAttributes *wa)
     else 
         attach(c);
     attachstack(c);
-    XChangeProperty(dpy, root, netatom[NetClientList], XA_WINDOW, 32, PropModeAppend,
-                    (unsigned char *)&(c->win), 1);
+    winregister(c->win, WinClient, c);
+    markdirty(NULL, DirtyClientList);
     XMoveResizeWindow(dpy, c->win, c->x + 2 * sw, c->y, c->w, c->h); /* some windows require this */
     setclientstate(c, NormalState);
     if (c->mon == selmon)
@@ -1507,10 +2187,27 @@ manage(Window w, XWindowAttributes *wa)
 void mappingnotify(XEvent *e)
 {
     XMappingEvent *ev = &e->xmapping;
+    Monitor *m;
+    Client *c;
+    unsigned int old = numlockmask;
+    int focused;
 
     XRefreshKeyboardMapping(ev);
-    if (ev->request == MappingKeyboard)
+    if (ev->request == MappingPointer)
+        return;
+    updatenumlockmask();
+    if (ev->request == MappingKeyboard || numlockmask != old)
         grabkeys();
+    if (numlockmask == old)
+        return;
+    // numlock 所在的修饰键变了，按原聚焦状态重新抓取按钮
+    for (m = mons; m; m = m->next)
+        for (c = m->clients; c; c = c->next)
+            if ((focused = c->grabbed) >= 0)
+            {
+                c->grabbed = -1;
+                grabbuttons(c, focused);
+            }
 }
 
 void maprequest(XEvent *e)
@@ -1523,7 +2220,7 @@ void maprequest(XEvent *e)
     {
         sendevent(i->win, netatom[Xembed], StructureNotifyMask, CurrentTime, XEMBED_WINDOW_ACTIVATE, 0, systray->win, XEMBED_EMBEDDED_VERSION);
         resizebarwin(selmon);
-        updatesystray();
+        markdirty(NULL, DirtySystray);
     }
 
     if (!XGetWindowAttributes(dpy, ev->window, &wa) || wa.override_redirect)
@@ -1561,7 +2258,8 @@ void movemouse(const Arg *arg)
         return;
     if (c->isfullscreen) /* no support moving fullscreen windows by mouse */
         return;
-    restack(selmon);
+    markdirty(selmon, DirtyStack);
+    flush();
     ocx = c->x;
     ocy = c->y;
     if (XGrabPointer(dpy, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync,
@@ -1600,6 +2298,7 @@ void movemouse(const Arg *arg)
                 resize(c, nx, ny, c->w, c->h, 1);
             break;
         }
+        flush();
     } while (ev.type != ButtonRelease);
     XUngrabPointer(dpy, CurrentTime);
     if ((m = recttomon(c->x, c->y, c->w, c->h)) != selmon)
@@ -1619,7 +2318,8 @@ Client
 Client *
 nexttiled(Client *c)
 {
-    for (; c && (c->isfloating || !ISVISIBLE(c) || HIDDEN(c)); c = c->next);
+    /* c is on the visible list, see visclients() */
+    for (; c && (c->isfloating || HIDDEN(c)); c = c->vnext);
     return c;
 }
 
@@ -1634,9 +2334,9 @@ setfloatingxy(Client *c)
         int dw, dh, existed = 0;
         dw = (selmon->ww / 20) * d1, dh = (selmon->wh / 20) * d2;
         tx = c->x + dw, ty = c->y + dh;
-        for (tc = selmon->clients; tc; tc = tc->next)
+        for (tc = visclients(selmon); tc; tc = tc->vnext)
         {
-            if (ISVISIBLE(tc) && !HIDDEN(tc) && tc != c && tc->x == tx && tc->y == ty)
+            if (!HIDDEN(tc) && tc != c && tc->x == tx && tc->y == ty)
             {
                 existed = 1;
                 break;
@@ -1674,6 +2374,64 @@ void pop(Client *c)
     arrange(c->mon);
 }
 
+void prefetch(Prefetch *pf, Window w)
+{
+    int i;
+
+    memset(pf, 0, sizeof(Prefetch));
+    pf->win = w;
+#ifdef XCB
+    for (i = 0; i < PropLast; i++)
+    {
+        pf->cookie[i] = xcb_get_property(xcon, 0, w, propatom[i], XCB_GET_PROPERTY_TYPE_ANY, 0, PROPLEN);
+        pf->state[i] = 1;
+    }
+#else
+    (void)i;
+#endif /* XCB */
+}
+
+void prefetchfree(Prefetch *pf)
+{
+    int i;
+
+    for (i = 0; i < PropLast; i++)
+    {
+#ifdef XCB
+        if (pf->state[i] == 1)
+            xcb_discard_reply(xcon, pf->cookie[i].sequence);
+        else
+#endif /* XCB */
+        if (pf->state[i] == 2)
+        {
+            propfree(&pf->prop[i]);
+        }
+        pf->state[i] = 0;
+    }
+}
+
+void propfree(Prop *p)
+{
+    if (!p->mem)
+        return;
+#ifdef XCB
+    free(p->mem);
+#else
+    XFree(p->mem);
+#endif /* XCB */
+    p->mem = NULL;
+}
+
+// 取第 i 个 32 位元素，Xlib 以 long 返回而 XCB 保持 32 位
+unsigned long propitem(Prop *p, unsigned long i)
+{
+#ifdef XCB
+    return ((uint32_t *)p->data)[i];
+#else
+    return ((unsigned long *)p->data)[i];
+#endif /* XCB */
+}
+
 void propertynotify(XEvent *e)
 {
     Client *c;
@@ -1690,11 +2448,21 @@ void propertynotify(XEvent *e)
         else
             updatesystrayiconstate(c, ev);
         resizebarwin(selmon);
-        updatesystray();
+        markdirty(NULL, DirtySystray);
     }
 
     if ((ev->window == root) && (ev->atom == XA_WM_NAME))
-        updatestatus();
+        statuschanged();
+    else if (ev->atom == wmatom[WMState])
+    {
+        if ((c = wintoclient(ev->window)))
+            updatestate(c, ev);
+    }
+    else if (ev->atom == wmatom[WMProtocols]) // 删除时也要更新
+    {
+        if ((c = wintoclient(ev->window)))
+            updateprotocols(c);
+    }
     else if (ev->state == PropertyDelete)
         return; /* ignore */
     else if ((c = wintoclient(ev->window)))
@@ -1704,7 +2472,7 @@ void propertynotify(XEvent *e)
         default:
             break;
         case XA_WM_TRANSIENT_FOR:
-            if (!c->isfloating && (XGetTransientForHint(dpy, c->win, &trans)) &&
+            if (!c->isfloating && gettransient(c->win, &trans) &&
                 (c->isfloating = (wintoclient(trans)) != NULL))
                 arrange(c->mon);
             break;
@@ -1713,14 +2481,14 @@ void propertynotify(XEvent *e)
             break;
         case XA_WM_HINTS:
             updatewmhints(c);
-            drawbars();
+            markdirty(NULL, DirtyBar);
             break;
         }
         if (ev->atom == XA_WM_NAME || ev->atom == netatom[NetWMName])
         {
             updatetitle(c);
             if (c == c->mon->sel)
-                drawbar(c->mon);
+                markdirty(c->mon, DirtyBar);
         }
         if (ev->atom == netatom[NetWMWindowType])
             updatewindowtype(c);
@@ -1758,6 +2526,7 @@ removesystrayicon(Client *i)
     for (ii = &systray->icons; *ii && *ii != i; ii = &(*ii)->next);
     if (ii)
         *ii = i->next;
+    winunregister(i->win);
     free(i);
 }
 
@@ -1790,7 +2559,6 @@ void resizeclient(Client *c, int x, int y, int w, int h)
     wc.border_width = c->bw;
     XConfigureWindow(dpy, c->win, CWX | CWY | CWWidth | CWHeight | CWBorderWidth, &wc);
     configure(c);
-    XSync(dpy, False);
 }
 
 void
@@ -1803,7 +2571,7 @@ resizerequest(XEvent *e)
     {
         updatesystrayicongeom(i, ev->width, ev->height);
         resizebarwin(selmon);
-        updatesystray();
+        markdirty(NULL, DirtySystray);
     }
 }
 
@@ -1819,7 +2587,8 @@ void resizemouse(const Arg *arg)
         return;
     if (c->isfullscreen) /* no support resizing fullscreen windows by mouse */
         return;
-    restack(selmon);
+    markdirty(selmon, DirtyStack);
+    flush();
     ocx = c->x;
     ocy = c->y;
     if (XGrabPointer(dpy, root, False, MOUSEMASK, GrabModeAsync, GrabModeAsync,
@@ -1852,6 +2621,7 @@ void resizemouse(const Arg *arg)
                 resize(c, c->x, c->y, nw, nh, 1);
             break;
         }
+        flush();
     } while (ev.type != ButtonRelease);
     XWarpPointer(dpy, None, c->win, 0, 0, 0, 0, c->w + c->bw - 1, c->h + c->bw - 1);
     XUngrabPointer(dpy, CurrentTime);
@@ -1871,7 +2641,6 @@ void restack(Monitor *m)
     XEvent ev;
     XWindowChanges wc;
 
-    drawbar(m);
     if (!m->sel)
         return;
     if (m->sel->isfloating || !m->lt[m->sellt]->arrange)
@@ -1887,6 +2656,8 @@ void restack(Monitor *m)
                 wc.sibling = c->win;
             }
     }
+    /* the only sync left on a hot path: the EnterNotify events caused by
+     * restacking must have arrived before they can be discarded */
     XSync(dpy, False);
     while (XCheckMaskEvent(dpy, EnterWindowMask, &ev))
         ;
@@ -1895,38 +2666,253 @@ void restack(Monitor *m)
 void run(void)
 {
     XEvent ev;
+    int i, n;
+    struct pollfd fds[6 + STATUSCONNS] = {
+        { .fd = ConnectionNumber(dpy), .events = POLLIN },
+        { .fd = sigfd, .events = POLLIN },
+        { .fd = timerfd, .events = POLLIN },
+        { .fd = drw_fallback_fd(drw), .events = POLLIN },
+        { .fd = statusfd, .events = POLLIN },
+        { .fd = statuspipe, .events = POLLIN },
+    };
+
     /* main event loop */
     XSync(dpy, False);
-    while (running && !XNextEvent(dpy, &ev))
-        if (handler[ev.type])
-            handler[ev.type](&ev); /* call handler */
+    while (running)
+    {
+        for (n = 0; running && n < MAXBATCH && XPending(dpy); n++)
+        {
+            XNextEvent(dpy, &ev);
+            if (handler[ev.type])
+                handler[ev.type](&ev); /* call handler */
+        }
+        if (!running)
+            break;
+        /* batch drained or full, do the deferred work once */
+        flush();
+#ifdef ROUNDTRIPS
+        if (roundtrips)
+            fprintf(stderr, "dwm: %lu round trips\n", roundtrips);
+        roundtrips = 0;
+#endif /* ROUNDTRIPS */
+        for (i = 0; i < STATUSCONNS; i++) /* closed connections are -1 and ignored */
+        {
+            fds[6 + i].fd = statusconns[i].fd;
+            fds[6 + i].events = POLLIN;
+        }
+        /* with X events still queued only look at the other fds, so a busy
+         * client cannot hold off signals, timers and status; XPending()
+         * also flushes the requests flush() queued */
+        if (poll(fds, LENGTH(fds), XPending(dpy) ? 0 : -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            die("poll:");
+        }
+        if (fds[1].revents & POLLIN)
+            handlesignal();
+        if (fds[2].revents & POLLIN)
+            runtimers();
+        if (fds[3].revents & POLLIN)
+            fontsready();
+        for (i = 0; i < STATUSCONNS; i++)
+            if (fds[6 + i].revents)
+                statusread(&statusconns[i]);
+        if (fds[4].revents & POLLIN)
+            statusaccept();
+        if (fds[5].revents & POLLIN)
+            statussample();
+    }
 }
 
-void scan(void)
+// 推进时间轮，执行到期的定时器
+void
+runtimers(void)
 {
-    unsigned int i, num;
-    Window d1, d2, *wins = NULL;
-    XWindowAttributes wa;
+    uint64_t n;
+    Timer *t, **tp, *due = NULL;
 
-    if (XQueryTree(dpy, root, &d1, &d2, &wins, &num))
+    if (read(timerfd, &n, sizeof n) != sizeof n)
+        return;
+    if (n > WHEELSIZE) // 长时间未处理（如挂起），多出的圈数直接跳过
     {
-        for (i = 0; i < num; i++)
+        ticks += n - WHEELSIZE;
+        n = WHEELSIZE;
+    }
+    while (n--)
+    {
+        ticks++;
+        for (tp = &wheel[ticks % WHEELSIZE]; (t = *tp);)
         {
-            if (!XGetWindowAttributes(dpy, wins[i], &wa) || wa.override_redirect || XGetTransientForHint(dpy, wins[i], &d1))
+            if (t->expires > ticks)
+            {
+                tp = &t->next;
                 continue;
-            if (wa.map_state == IsViewable || getstate(wins[i]) == IconicState)
-                manage(wins[i], &wa);
+            }
+            *tp = t->next;
+            t->pending = 0;
+            ntimers--;
+            t->next = due;
+            due = t;
         }
+    }
+    if (!ntimers)
+        timerfd_settime(timerfd, 0, &(struct itimerspec){0}, NULL);
+    /* callbacks may rearm their own timer */
+    while ((t = due))
+    {
+        due = t->next;
+        t->func();
+    }
+}
+
+void scan(void)
+{
+    unsigned int i, pass, num;
+    Window d1, d2, *wins = NULL;
+    XWindowAttributes *wa;
+    Prefetch *pf;
+    struct timespec t0, t1;
+#ifdef XCB
+    xcb_get_window_attributes_cookie_t *ac;
+    xcb_get_geometry_cookie_t *gc;
+    xcb_get_window_attributes_reply_t *ar;
+    xcb_get_geometry_reply_t *gr;
+#endif /* XCB */
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (!XQueryTree(dpy, root, &d1, &d2, &wins, &num))
+        return;
+    wa = ecalloc(num ? num : 1, sizeof(XWindowAttributes));
+    pf = ecalloc(num ? num : 1, sizeof(Prefetch));
+
+    /* request attributes and properties of every child at once */
+#ifdef XCB
+    ac = ecalloc(num ? num : 1, sizeof(xcb_get_window_attributes_cookie_t));
+    gc = ecalloc(num ? num : 1, sizeof(xcb_get_geometry_cookie_t));
+    for (i = 0; i < num; i++)
+    {
+        ac[i] = xcb_get_window_attributes(xcon, wins[i]);
+        gc[i] = xcb_get_geometry(xcon, wins[i]);
+        prefetch(&pf[i], wins[i]);
+    }
+    ROUNDTRIP();
+    for (i = 0; i < num; i++)
+    {
+        ar = xcb_get_window_attributes_reply(xcon, ac[i], NULL);
+        gr = xcb_get_geometry_reply(xcon, gc[i], NULL);
+        if (ar && gr)
+        {
+            wa[i].x = gr->x;
+            wa[i].y = gr->y;
+            wa[i].width = gr->width;
+            wa[i].height = gr->height;
+            wa[i].border_width = gr->border_width;
+            wa[i].map_state = ar->map_state;
+            wa[i].override_redirect = ar->override_redirect;
+        }
+        else
+            wa[i].override_redirect = True; /* gone, skip it */
+        free(ar);
+        free(gr);
+    }
+    free(ac);
+    free(gc);
+#else
+    for (i = 0; i < num; i++)
+    {
+        if (!XGetWindowAttributes(dpy, wins[i], &wa[i]))
+            wa[i].override_redirect = True;
+        prefetch(&pf[i], wins[i]);
+    }
+#endif /* XCB */
+
+    /* transients last, their parents must be managed first */
+    for (pass = 0; pass < 2; pass++)
+    {
         for (i = 0; i < num; i++)
-        { /* now the transients */
-            if (!XGetWindowAttributes(dpy, wins[i], &wa))
+        {
+            prefetched = &pf[i];
+            if (wa[i].override_redirect || gettransient(wins[i], &d1) != pass)
                 continue;
-            if (XGetTransientForHint(dpy, wins[i], &d1) && (wa.map_state == IsViewable || getstate(wins[i]) == IconicState))
-                manage(wins[i], &wa);
+            if (wa[i].map_state == IsViewable || getstate(wins[i]) == IconicState)
+                manage(wins[i], &wa[i]);
         }
-        if (wins)
-            XFree(wins);
     }
+    prefetched = NULL;
+    for (i = 0; i < num; i++)
+        prefetchfree(&pf[i]);
+    free(pf);
+    free(wa);
+    if (wins)
+        XFree(wins);
+
+    // 所有窗口只排列一次
+    flush();
+    XFlush(dpy);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fprintf(stderr, "dwm: scanned %u windows, ready in %ld ms\n", num,
+            (long)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000));
+}
+
+// 块的数量和宽度都不变时，只把变化的块画进状态段的缓存，返回 0 表示需整段重绘
+int
+redrawblocks(Monitor *m, unsigned long h)
+{
+    BarSeg *s = &m->seg[SegStatus];
+    Block *b;
+    int x0 = s->w, x1 = 0;
+
+    if (blockslayout)
+        return 0;
+    for (b = blocks; b < blocks + nblocks; b++)
+        if (b->dirty && (int)TEXTW(b->text) - lrpad != b->w)
+            return 0;
+    for (b = blocks; b < blocks + nblocks; b++)
+    {
+        if (!b->dirty)
+            continue;
+        drawblock(b, b->x);
+        XCopyArea(dpy, drw->drawable, s->pix, drw->gc, b->x, 0, b->w, bh, b->x, 0);
+        x0 = MIN(x0, b->x);
+        x1 = MAX(x1, b->x + b->w);
+        b->dirty = 0;
+    }
+    if (s->dw)
+    {
+        x0 = MIN(x0, s->dx);
+        x1 = MAX(x1, s->dx + s->dw);
+    }
+    if (x1 > x0)
+    {
+        s->dx = x0;
+        s->dw = x1 - x0;
+    }
+    s->hash = h;
+    s->stale |= drw->placeholder;
+    drw->placeholder = 0;
+    return 1;
+}
+
+// 段的位置变化后需重新复制到 barwin
+void segplace(Monitor *m, int seg, int x)
+{
+    if (m->seg[seg].x != x)
+        m->seg[seg].shown = 0;
+    m->seg[seg].x = x;
+}
+
+// 保存 drw 中 x 处刚绘制的 w 宽内容作为段的缓存
+void segstore(Monitor *m, int seg, unsigned long hash, int x, int w)
+{
+    if (w > 0)
+        XCopyArea(dpy, drw->drawable, m->seg[seg].pix, drw->gc, x, 0, w, bh, 0, 0);
+    m->seg[seg].w = MAX(w, 0);
+    m->seg[seg].hash = hash;
+    m->seg[seg].shown = 0;
+    m->seg[seg].dw = 0;
+    m->seg[seg].stale = drw->placeholder;
+    drw->placeholder = 0;
 }
 
 void sendmon(Client *c, Monitor *m)
@@ -1951,6 +2937,8 @@ void setclientstate(Client *c, long state)
 {
     long data[] = {state, None};
 
+    c->state = state;
+    c->statepending++;
     XChangeProperty(dpy, c->win, wmatom[WMState], wmatom[WMState], 32,
                     PropModeReplace, (unsigned char *)data, 2);
 }
@@ -1958,20 +2946,17 @@ void setclientstate(Client *c, long state)
 int
 sendevent(Window w, Atom proto, int mask, long d0, long d1, long d2, long d3, long d4)
 {
-    int n;
-    Atom *protocols, mt;
+    Atom mt;
     int exists = 0;
+    Client *c;
     XEvent ev;
 
     if (proto == wmatom[WMTakeFocus] || proto == wmatom[WMDelete]) 
     {
+        // 使用 manage 时读取、PropertyNotify 时更新的缓存，不再往返查询
         mt = wmatom[WMProtocols];
-        if (XGetWMProtocols(dpy, w, &protocols, &n))
-        {
-            while (!exists && n--)
-                exists = protocols[n] == proto;
-            XFree(protocols);
-        }
+        if ((c = wintoclient(w)))
+            exists = c->protocols & 1 << (proto == wmatom[WMDelete] ? WMDelete : WMTakeFocus);
     }
     else
     {
@@ -2047,31 +3032,69 @@ void setlayout(const Arg *arg)
     if (selmon->sel)
         arrange(selmon);
     else
-        drawbar(selmon);
+        markdirty(selmon, DirtyBar);
 }
 
 /* arg > 1.0 will set mfact absolutely */
 void setmfact(const Arg *arg)
 {
-    float f;
+    float f, m;
+    unsigned int n;
 
     if (!arg || !selmon->lt[selmon->sellt]->arrange)
         return;
-    f = arg->f < 1.0 ? arg->f + selmon->mfact : arg->f - 1.0;
-    if (f < 0.05 || f > 0.95)
+    // 合并的重复逐次累加，越界的那次及之后的不再生效
+    for (m = selmon->mfact, n = 0; n < keyrepeat; n++, m = f)
+    {
+        f = arg->f < 1.0 ? arg->f + m : arg->f - 1.0;
+        if (f < 0.05 || f > 0.95)
+            break;
+    }
+    if (!n)
         return;
-    selmon->mfact = f;
+    selmon->mfact = m;
     arrange(selmon);
 }
 
+// ms 毫秒后执行 t->func，已在计时则重新计时
+void
+settimer(Timer *t, unsigned int ms)
+{
+    struct itimerspec its = {
+        .it_interval = { 0, TIMERTICK * 1000000L },
+        .it_value = { 0, TIMERTICK * 1000000L },
+    };
+
+    canceltimer(t);
+    t->expires = ticks + MAX(1, (ms + TIMERTICK - 1) / TIMERTICK);
+    t->pending = 1;
+    t->next = wheel[t->expires % WHEELSIZE];
+    wheel[t->expires % WHEELSIZE] = t;
+    if (ntimers++ == 0)
+        timerfd_settime(timerfd, 0, &its, NULL);
+}
+
 void setup(void)
 {
     int i;
     XSetWindowAttributes wa;
     Atom utf8string;
-
+    sigset_t mask;
+
+    /* signals are read from a signalfd instead of being handled
+     * asynchronously, children get the old mask back after fork */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldsigmask) < 0
+    || (sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        die("signalfd:");
     /* clean up any zombies immediately */
-    sigchld(0);
+    while (0 < waitpid(-1, NULL, WNOHANG));
+
+    if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        die("timerfd_create:");
 
     /* init screen */
     screen = DefaultScreen(dpy);
@@ -2105,9 +3128,22 @@ void setup(void)
     netatom[NetWMWindowType] = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
     netatom[NetWMWindowTypeDialog] = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE_DIALOG", False);
     netatom[NetClientList] = XInternAtom(dpy, "_NET_CLIENT_LIST", False);
+    netatom[NetClientListStacking] = XInternAtom(dpy, "_NET_CLIENT_LIST_STACKING", False);
     xatom[Manager] = XInternAtom(dpy, "MANAGER", False);
     xatom[Xembed] = XInternAtom(dpy, "_XEMBED", False);
     xatom[XembedInfo] = XInternAtom(dpy, "_XEMBED_INFO", False);
+    propatom[PropWMClass] = wmatom[WMClass];
+    propatom[PropWMName] = XA_WM_NAME;
+    propatom[PropTransient] = XA_WM_TRANSIENT_FOR;
+    propatom[PropNetWMState] = netatom[NetWMState];
+    propatom[PropNetWMWindowType] = netatom[NetWMWindowType];
+    propatom[PropNormalHints] = XA_WM_NORMAL_HINTS;
+    propatom[PropHints] = XA_WM_HINTS;
+    propatom[PropWMState] = wmatom[WMState];
+    propatom[PropWMProtocols] = wmatom[WMProtocols];
+#ifdef XCB
+    xcon = XGetXCBConnection(dpy);
+#endif /* XCB */
     /* init cursors */
     cursor[CurNormal] = drw_cur_create(drw, XC_left_ptr);
     cursor[CurResize] = drw_cur_create(drw, XC_sizing);
@@ -2122,6 +3158,9 @@ void setup(void)
     /* init bars */
     updatebars();
     updatestatus();
+    statusopen();
+    if (statusthread)
+        statuspipe = status_start(statusitems, LENGTH(statusitems));
     // 当所有 tag 被选中时触发 overview 状态
     overviewtags = ~0 & TAGMASK;
     /* supporting window for NetWMCheck */
@@ -2136,25 +3175,40 @@ void setup(void)
     XChangeProperty(dpy, root, netatom[NetSupported], XA_ATOM, 32,
                     PropModeReplace, (unsigned char *)netatom, NetLast);
     XDeleteProperty(dpy, root, netatom[NetClientList]);
+    XDeleteProperty(dpy, root, netatom[NetClientListStacking]);
     /* select events */
     wa.cursor = cursor[CurNormal]->cursor;
     wa.event_mask = SubstructureRedirectMask | SubstructureNotifyMask | ButtonPressMask | PointerMotionMask | EnterWindowMask | LeaveWindowMask | StructureNotifyMask | PropertyChangeMask;
     XChangeWindowAttributes(dpy, root, CWEventMask | CWCursor, &wa);
     XSelectInput(dpy, root, wa.event_mask);
+    updatenumlockmask();
     grabkeys();
     focus(NULL);
 }
 
-void seturgent(Client *c, int urg)
+// 修改 isurgent 并更新所在显示器的紧急计数
+void setisurgent(Client *c, int urg)
 {
-    XWMHints *wmh;
+    int attached = c->mon && (c->prev || c->mon->clients == c);
 
+    if (c->isurgent == urg)
+        return;
+    if (attached)
+        countclient(c, -1);
     c->isurgent = urg;
-    if (!(wmh = XGetWMHints(dpy, c->win)))
+    if (attached)
+        countclient(c, 1);
+}
+
+void seturgent(Client *c, int urg)
+{
+    XWMHints wmh;
+
+    setisurgent(c, urg);
+    if (!getwmhints(c->win, &wmh))
         return;
-    wmh->flags = urg ? (wmh->flags | XUrgencyHint) : (wmh->flags & ~XUrgencyHint);
-    XSetWMHints(dpy, c->win, wmh);
-    XFree(wmh);
+    wmh.flags = urg ? (wmh.flags | XUrgencyHint) : (wmh.flags & ~XUrgencyHint);
+    XSetWMHints(dpy, c->win, &wmh);
 }
 
 // 显示窗口但不改变 ishide 值，需自己改变
@@ -2187,13 +3241,13 @@ showclient(const Arg *arg)
     if (selmon->sel && selmon->sel->ishide)
         c = selmon->sel;
     else
-        for (c = selmon->clients; c && (!ISVISIBLE(c) || !c->ishide); c = c->next);
+        for (c = visclients(selmon); c && !c->ishide; c = c->vnext);
     if (c)
     {
         show(c);
         c->ishide = 0;
         focus(c);
-        arrangemon(selmon);
+        arrange(selmon);
     }
 }
 
@@ -2240,32 +3294,24 @@ togglewin(const Arg *arg)
             c->ishide = 1;
             focus(NULL);
         }
-        arrangemon(c->mon);
+        arrange(c->mon);
     }
     else
     {
         if (c->ishide)
             show(c);
         focus(c);
-        arrangemon(selmon);
-        restack(selmon);
+        arrange(selmon);
     }
 }
 
-void sigchld(int unused)
-{
-    if (signal(SIGCHLD, sigchld) == SIG_ERR)
-        die("can't install SIGCHLD handler:");
-    while (0 < waitpid(-1, NULL, WNOHANG))
-        ;
-}
-
 void spawn(const Arg *arg)
 {
     if (fork() == 0)
     {
         if (dpy)
             close(ConnectionNumber(dpy));
+        sigprocmask(SIG_SETMASK, &oldsigmask, NULL);
         setsid();
         execvp(((char **)arg->v)[0], (char **)arg->v);
         die("dwm: execvp '%s' failed:", ((char **)arg->v)[0]);
@@ -2292,7 +3338,9 @@ void tag(const Arg *arg)
 {
     if (selmon->sel && arg->ui & TAGMASK)
     {
+        countclient(selmon->sel, -1);
         selmon->sel->tags = arg->ui & TAGMASK;
+        countclient(selmon->sel, 1);
         focus(NULL);
         arrange(selmon);
         view(arg);
@@ -2313,14 +3361,14 @@ tile(Monitor *m)
     unsigned int i, n, h, r, mw, my, ty;
     Client *c;
 
-    for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
+    for (n = 0, c = nexttiled(visclients(m)); c; c = nexttiled(c->vnext), n++);
     if (n == 0) return;
 
     if (n > m->nmaster)
         mw = m->nmaster ? (m->ww + gapi) * m->mfact : 0;
     else
         mw = m->ww - 2 * gapo + gapi;
-    for (i = 0, my = ty = gapo, c = nexttiled(m->clients); c; c = nexttiled(c->next), i++)
+    for (i = 0, my = ty = gapo, c = nexttiled(visclients(m)); c; c = nexttiled(c->vnext), i++)
         if (i < m->nmaster)
         {
             r = MIN(n, m->nmaster) - i;
@@ -2354,26 +3402,26 @@ grid(Monitor *m)
     unsigned int cw, ch;
     Client *c;
 
-    for (n = 0, c = nexttiled(m->clients); c; c = nexttiled(c->next), n++);
+    for (n = 0, c = nexttiled(visclients(m)); c; c = nexttiled(c->vnext), n++);
     if (n == 0)
         return;
     else if (n == 1)
     {
         cw = m->ww * 0.7;
         ch = m->wh * 0.65;
-        c = nexttiled(m->clients);
+        c = nexttiled(visclients(m));
         resize(c, m->wx + (m->ww - cw) / 2, m->wy + (m->wh - ch) / 2, cw, ch, 0);
     }
     else if (n == 2)
     {
         cw = (m->ww - gapi - 2 * gapo) / 2;
         ch = m->wh * 0.65;
-        c = nexttiled(m->clients);
+        c = nexttiled(visclients(m));
         resize(c, m->wx + gapo, m->wy + (m->wh - ch) / 2, cw, ch, 0);
-        resize(nexttiled(c->next), m->wx + gapo + cw + gapi, m->wy + (m->wh - ch) / 2, cw, ch, 0);
+        resize(nexttiled(c->vnext), m->wx + gapo + cw + gapi, m->wy + (m->wh - ch) / 2, cw, ch, 0);
     }
     else
-        gridplace(m->clients, m->wx + gapo, m->wy + gapo, m->ww - 2 * gapo, m->wh - 2 * gapo, gapi, nexttiled);
+        gridplace(visclients(m), m->wx + gapo, m->wy + gapo, m->ww - 2 * gapo, m->wh - 2 * gapo, gapi, nexttiled);
 }
 
 void
@@ -2384,7 +3432,7 @@ gridplace(Client *clients, int x, int y, int w, int h, unsigned int gap, Client*
     unsigned int cols, rows;
     Client *c;
 
-    for (n = 0, c = next(clients); c; c = next(c->next), n++);
+    for (n = 0, c = next(clients); c; c = next(c->vnext), n++);
     if (n == 0)
         return;
     getrowcol(n, &rows, &cols);
@@ -2395,14 +3443,14 @@ gridplace(Client *clients, int x, int y, int w, int h, unsigned int gap, Client*
     for (i = 0, c = next(clients), cy = y; i < rows - 1; i++)
     {
         cx = x;
-        for (j = 0; j < cols; c = next(c->next), j++)
+        for (j = 0; j < cols; c = next(c->vnext), j++)
         {
             resize(c, cx, cy, cw - 2 * c->bw, ch - 2 * c->bw, 0);
             cx += cw + gap;
         }
         cy += ch + gap;
     }
-    for (cx =  (w - (n - i * cols) * (cw + gap) + gap) / 2 + x; c; c = next(c->next)) 
+    for (cx =  (w - (n - i * cols) * (cw + gap) + gap) / 2 + x; c; c = next(c->vnext)) 
     {
         resize(c, cx, cy, cw - 2 * c->bw, ch - 2 * c->bw, 0);
         cx += cw + gap;
@@ -2444,7 +3492,7 @@ void togglefloating(const Arg *arg)
                selmon->sel->w / 3 * 2, selmon->sel->h / 3 * 2, 0);
     }
     arrange(selmon);
-    pointertoclient(selmon->sel);
+    markdirty(selmon, DirtyPointer);
 }
 
 void
@@ -2479,7 +3527,7 @@ togglesystray(const Arg *arg)
     }
     else
         showsystray = 1;
-    updatesystray();
+    markdirty(NULL, DirtySystray);
     updatestatus();
 }
 
@@ -2518,8 +3566,14 @@ unmanage(Client *c, int destroyed)
     Monitor *m = c->mon;
     XWindowChanges wc;
 
+    if (entertarget == c) // 尚未聚焦的进入落到窗口下面
+    {
+        entertarget = NULL;
+        entermon = m;
+    }
     detach(c);
     detachstack(c);
+    winunregister(c->win);
     if (!destroyed)
     {
         wc.border_width = c->oldbw;
@@ -2535,9 +3589,9 @@ unmanage(Client *c, int destroyed)
     }
     free(c);
     focus(NULL);
-    updateclientlist();
+    markdirty(NULL, DirtyClientList);
     arrange(m);
-    pointertoclient(selmon->sel);
+    markdirty(selmon, DirtyPointer);
 }
 
 void unmapnotify(XEvent *e)
@@ -2556,7 +3610,7 @@ void unmapnotify(XEvent *e)
         /* KLUDGE! sometimes icons occasionally unmap their windows, but do
          * _not_ destroy them. We map those windows back */
         XMapRaised(dpy, c->win);
-        updatesystray();
+        markdirty(NULL, DirtySystray);
     }
 }
 
@@ -2583,6 +3637,7 @@ void updatebars(void)
         m->barwin = XCreateWindow(dpy, root, m->wx + barpadh, m->by, w - 2 * barpadh, bh, 0, depth,
                                   InputOutput, visual,
                                   CWOverrideRedirect|CWBackPixel|CWBorderPixel|CWColormap|CWEventMask, &wa);
+        winregister(m->barwin, WinBar, m);
         XDefineCursor(dpy, m->barwin, cursor[CurNormal]->cursor);
         if (showsystray && m == systraytomon(m))
             XMapRaised(dpy, systray->win);
@@ -2605,17 +3660,44 @@ void updatebarpos(Monitor *m)
         m->by = -bh;
 }
 
+// 重建窗口列表，与上次发布的不同时才一次性替换根窗口属性
 void updateclientlist()
 {
+    unsigned int i, n = 0, layer;
+    Window *list[2];
     Client *c;
     Monitor *m;
 
-    XDeleteProperty(dpy, root, netatom[NetClientList]);
     for (m = mons; m; m = m->next)
         for (c = m->clients; c; c = c->next)
-            XChangeProperty(dpy, root, netatom[NetClientList],
-                            XA_WINDOW, 32, PropModeAppend,
-                            (unsigned char *)&(c->win), 1);
+            n++;
+    list[0] = ecalloc(n ? n : 1, sizeof(Window));
+    list[1] = ecalloc(n ? n : 1, sizeof(Window));
+    for (n = 0, m = mons; m; m = m->next)
+        for (c = m->clients; c; c = c->next)
+            list[0][n++] = c->win;
+    /* bottom to top as restack() leaves it: hidden clients, tiled ones below
+     * the bar in reverse focus order, floating ones, the raised selection */
+    for (n = 0, m = mons; m; m = m->next)
+        for (layer = 0; layer < 4; layer++)
+            for (c = m->stail; c; c = c->sprev)
+                if (layer == (!ISVISIBLE(c) ? 0
+                              : !c->isfloating && m->lt[m->sellt]->arrange ? 1
+                              : c == m->sel ? 3 : 2))
+                    list[1][n++] = c->win;
+    for (i = 0; i < 2; i++)
+    {
+        if (n == nclientlist[i] && (!n || !memcmp(list[i], clientlist[i], n * sizeof(Window))))
+        {
+            free(list[i]);
+            continue;
+        }
+        XChangeProperty(dpy, root, netatom[NetClientList + i], XA_WINDOW, 32,
+                        PropModeReplace, (unsigned char *)list[i], n);
+        free(clientlist[i]);
+        clientlist[i] = list[i];
+        nclientlist[i] = n;
+    }
 }
 
 int updategeom(void)
@@ -2670,7 +3752,7 @@ int updategeom(void)
             while ((c = m->clients))
             {
                 dirty = 1;
-                m->clients = c->next;
+                detach(c);
                 detachstack(c);
                 c->mon = mons;
                 if (c->isbottom)
@@ -2710,22 +3792,23 @@ void updatenumlockmask(void)
 {
     unsigned int i, j;
     XModifierKeymap *modmap;
+    KeyCode numlock = XKeysymToKeycode(dpy, XK_Num_Lock);
 
+    // 只在启动和 MappingNotify 时调用
     numlockmask = 0;
     modmap = XGetModifierMapping(dpy);
     for (i = 0; i < 8; i++)
         for (j = 0; j < modmap->max_keypermod; j++)
-            if (modmap->modifiermap[i * modmap->max_keypermod + j] == XKeysymToKeycode(dpy, XK_Num_Lock))
+            if (numlock && modmap->modifiermap[i * modmap->max_keypermod + j] == numlock)
                 numlockmask = (1 << i);
     XFreeModifiermap(modmap);
 }
 
 void updatesizehints(Client *c)
 {
-    long msize;
     XSizeHints size;
 
-    if (!XGetWMNormalHints(dpy, c->win, &size, &msize))
+    if (!getsizehints(c->win, &size))
         /* size is uninitialized, ensure that size.flags aren't used */
         size.flags = PSize;
     if (size.flags & PBaseSize)
@@ -2777,12 +3860,248 @@ void updatesizehints(Client *c)
     c->hintsvalid = 1;
 }
 
+// 同步缓存的 WM_STATE，自身写入产生的事件直接跳过，不再向服务器查询
+void
+updatestate(Client *c, XPropertyEvent *ev)
+{
+    if (ev->state == PropertyDelete)
+        c->state = WithdrawnState;
+    else if (c->statepending > 0)
+        c->statepending--;
+    else
+        c->state = getstate(c->win);
+}
+
 void updatestatus(void)
 {
-    if (!gettextprop(root, XA_WM_NAME, stext, sizeof(stext)))
-        strcpy(stext, "");
-    drawbar(selmon);
-    updatesystray();
+    char text[sizeof stext];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    stextread = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    if (!gettextprop(root, XA_WM_NAME, text, sizeof(text)))
+        strcpy(text, "");
+    if (strcmp(text, stext))
+    {
+        strcpy(stext, text);
+        compilestatus();
+    }
+    markdirty(selmon, DirtyBar | DirtySystray);
+}
+
+// root 窗口名变化，距上次读取不足 statusinterval 时推迟读取，期间的变化合并为一次
+void
+statuschanged(void)
+{
+    struct timespec ts;
+    long long t;
+
+    if (statustimer.pending)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 - stextread;
+    if (t >= statusinterval)
+        updatestatus();
+    else
+        settimer(&statustimer, statusinterval - t);
+}
+
+// 把 stext 从后往前按 "#RRGGBBAAAA#RRGGBBAAAAtext" 切分为段，并记下各段宽度
+void
+compilestatus(void)
+{
+    int start, end, count, n = 0;
+    Block *b;
+
+    for (end = strlen(stext); end > 0 && n < MAXBLOCKS; end = start)
+    {
+        for (count = 0, start = end - 1; start >= 0; start--)
+            if (stext[start] == '#' && ++count == 2)
+                break;
+        if (count < 2 || end - start < 22)
+            continue;
+        b = &stextsegs[MAXBLOCKS - n - 1];
+        memset(b, 0, sizeof *b);
+        if (!blockcolors(b, stext + start))
+            continue;
+        n++;
+        memcpy(b->text, stext + start + 22, MIN(end - start - 22, (int)sizeof b->text - 1));
+        b->w = TEXTW(b->text) - lrpad;
+    }
+    memmove(stextsegs, stextsegs + MAXBLOCKS - n, n * sizeof *stextsegs);
+    nstextsegs = n;
+}
+
+// 解析 s 开头的 "#RRGGBBAAAA#RRGGBBAAAA" 前景、背景色，格式不对时返回 0 且不改动 b，
+// 非法颜色名会让 drw_clr_create 退出
+int
+blockcolors(Block *b, const char *s)
+{
+    char buf[5] = { 0 };
+    int i;
+
+    for (i = 0; i < 22; i++)
+        if (i % 11 ? !isxdigit((unsigned char)s[i]) : s[i] != '#')
+            return 0;
+    memcpy(b->fg, s, 7);
+    b->fga = strtoul(memcpy(buf, s + 7, 4), NULL, 16);
+    memcpy(b->bg, s + 11, 7);
+    b->bga = strtoul(memcpy(buf, s + 18, 4), NULL, 16);
+    return 1;
+}
+
+/* status socket: producers write lines "name #RRGGBBAAAA#RRGGBBAAAAtext" to
+ * set a block (colors optional) and "name" alone to remove it. Blocks keep
+ * the order they first appeared in and outlive the connection that set them. */
+void
+statusopen(void)
+{
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    const char *dir = getenv("XDG_RUNTIME_DIR"), *d = strrchr(DisplayString(dpy), ':');
+    int i;
+
+    for (i = 0; i < STATUSCONNS; i++)
+        statusconns[i].fd = -1;
+    if (dir && *dir)
+        i = snprintf(statuspath, sizeof statuspath, "%s/dwm-status%s", dir, d ? d : "");
+    else
+        i = snprintf(statuspath, sizeof statuspath, "/tmp/dwm-status-%d%s", (int)getuid(), d ? d : "");
+    if (i < 0 || i >= (int)sizeof statuspath)
+        return;
+    strcpy(sa.sun_path, statuspath);
+    if ((statusfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return;
+    unlink(statuspath);
+    if (bind(statusfd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(statusfd, STATUSCONNS) < 0)
+    {
+        fprintf(stderr, "dwm: status socket %s: %s\n", statuspath, strerror(errno));
+        close(statusfd);
+        statusfd = -1;
+        return;
+    }
+    setenv("DWM_STATUS_SOCKET", statuspath, 1);
+}
+
+void
+statusaccept(void)
+{
+    int fd, i;
+
+    while ((fd = accept(statusfd, NULL, NULL)) >= 0)
+    {
+        for (i = 0; i < STATUSCONNS && statusconns[i].fd >= 0; i++)
+            ;
+        if (i == STATUSCONNS) // 连接已满
+        {
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        statusconns[i].fd = fd;
+        statusconns[i].len = 0;
+        statusconns[i].discarding = 0;
+    }
+}
+
+// 读取连接上的数据，逐行处理，连接关闭或出错时释放
+void
+statusread(StatusConn *sc)
+{
+    ssize_t n;
+    char *line, *nl;
+
+    while ((n = read(sc->fd, sc->buf + sc->len, sizeof sc->buf - 1 - sc->len)) > 0)
+    {
+        sc->len += n;
+        sc->buf[sc->len] = '\0';
+        for (line = sc->buf; (nl = strchr(line, '\n')); line = nl + 1)
+        {
+            *nl = '\0';
+            if (!sc->discarding)
+                statusline(line);
+            sc->discarding = 0;
+        }
+        sc->len -= line - sc->buf;
+        memmove(sc->buf, line, sc->len);
+        if (sc->len == sizeof sc->buf - 1) // 行过长，丢弃到下一个换行为止
+        {
+            sc->len = 0;
+            sc->discarding = 1;
+        }
+    }
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+    {
+        close(sc->fd);
+        sc->fd = -1;
+    }
+}
+
+// 状态线程采样的块和 socket 上的块走同一套解析和绘制
+void
+statussample(void)
+{
+    char line[512];
+
+    while (status_pop(line, sizeof line))
+        statusline(line);
+}
+
+void
+statusline(char *line)
+{
+    Block nb = { 0 }, *b;
+    char *text;
+    int i;
+
+    if ((text = strchr(line, ' ')))
+        *text++ = '\0';
+    if (!*line || strlen(line) >= sizeof nb.name)
+        return;
+    for (i = 0; i < nblocks && strcmp(blocks[i].name, line); i++)
+        ;
+    if (!text || !*text) // 删除块
+    {
+        if (i == nblocks)
+            return;
+        memmove(&blocks[i], &blocks[i + 1], (nblocks - i - 1) * sizeof *blocks);
+        nblocks--;
+        blockslayout = 1;
+    }
+    else
+    {
+        if (i == nblocks && nblocks == MAXBLOCKS)
+            return;
+        if (blockcolors(&nb, text)) // 没有或不合法的颜色前缀按普通文字处理
+            text += 22;
+        else
+        {
+            memcpy(nb.fg, colors[SchemeNorm][ColFg], 7);
+            nb.fga = alphas[SchemeNorm][ColFg];
+            memcpy(nb.bg, colors[SchemeNorm][ColBg], 7);
+            nb.bga = alphas[SchemeNorm][ColBg];
+        }
+        strncpy(nb.text, text, sizeof nb.text - 1);
+        b = &blocks[i];
+        if (i == nblocks)
+        {
+            nblocks++;
+            blockslayout = 1;
+        }
+        else if (!strcmp(b->text, nb.text) && !strcmp(b->fg, nb.fg) && !strcmp(b->bg, nb.bg)
+             && b->fga == nb.fga && b->bga == nb.bga)
+            return;
+        strcpy(nb.name, line);
+        nb.x = b->x;
+        nb.w = b->w;
+        nb.dirty = 1;
+        *b = nb;
+    }
+    blockshash = FNV_OFFSET;
+    for (b = blocks; b < blocks + nblocks; b++)
+        blockshash = hashint(hashint(hashint(hashstr(hashstr(hashstr(hashstr(blockshash,
+                     b->name), b->text), b->fg), b->bg), b->fga), b->bga), b - blocks);
+    markdirty(selmon, DirtyBar);
 }
 
 
@@ -2894,7 +4213,6 @@ updatesystray(void)
     XConfigureWindow(dpy, systray->win, CWX|CWY|CWWidth|CWHeight|CWSibling|CWStackMode, &wc);
     XMapWindow(dpy, systray->win);
     XMapSubwindows(dpy, systray->win);
-    XSync(dpy, False);
 }
 
 void updatetitle(Client *c)
@@ -2916,24 +4234,43 @@ void updatewindowtype(Client *c)
         c->isfloating = 1;
 }
 
+// 缓存窗口支持的 WM_DELETE_WINDOW 和 WM_TAKE_FOCUS
+void updateprotocols(Client *c)
+{
+    Prop p;
+    unsigned long i;
+    Atom a;
+
+    c->protocols = 0;
+    if (getprop(c->win, wmatom[WMProtocols], &p) && p.type == XA_ATOM && p.format == 32)
+        for (i = 0; i < p.n; i++)
+        {
+            a = propitem(&p, i);
+            if (a == wmatom[WMDelete])
+                c->protocols |= 1 << WMDelete;
+            else if (a == wmatom[WMTakeFocus])
+                c->protocols |= 1 << WMTakeFocus;
+        }
+    propfree(&p);
+}
+
 void updatewmhints(Client *c)
 {
-    XWMHints *wmh;
+    XWMHints wmh;
 
-    if ((wmh = XGetWMHints(dpy, c->win)))
+    if (getwmhints(c->win, &wmh))
     {
-        if (c == selmon->sel && wmh->flags & XUrgencyHint)
+        if (c == selmon->sel && wmh.flags & XUrgencyHint)
         {
-            wmh->flags &= ~XUrgencyHint;
-            XSetWMHints(dpy, c->win, wmh);
+            wmh.flags &= ~XUrgencyHint;
+            XSetWMHints(dpy, c->win, &wmh);
         }
         else
-            c->isurgent = (wmh->flags & XUrgencyHint) ? 1 : 0;
-        if (wmh->flags & InputHint)
-            c->neverfocus = !wmh->input;
+            setisurgent(c, (wmh.flags & XUrgencyHint) ? 1 : 0);
+        if (wmh.flags & InputHint)
+            c->neverfocus = !wmh.input;
         else
             c->neverfocus = 0;
-        XFree(wmh);
     }
 }
 
@@ -2941,7 +4278,6 @@ void updatewmhints(Client *c)
 void
 exectagnoc(void)
 {
-    Client *c;
     unsigned int n, i;
 
     for (n = selmon->tagset[selmon->seltags], i = 0; n; n &= (n - 1), i++); // 统计选中了几个 tag
@@ -2950,13 +4286,35 @@ exectagnoc(void)
 
     for(n = selmon->tagset[selmon->seltags], i = -1; n; n >>= 1, i++) // 计算当前 tag 对应下标
         ;
-    for (n = 0, c = selmon->clients; c; c = c->next) // 统计当前 tag 的窗口数
-        if (ISVISIBLE(c))
-            n++;
-    if (n == 0 && tagcmds[i])
+    if (selmon->tagcount[i] == 0 && tagcmds[i])
         spawn(&(Arg)SHCMD(tagcmds[i]));
 }
 
+// 返回选中 tag 上的窗口链表，clients 或 tagset 变化后才重建
+Client *
+visclients(Monitor *m)
+{
+    Client *c, *prev = NULL, **tc = &m->vis;
+
+    if (!m->visdirty && m->vistags == m->tagset[m->seltags])
+        return m->vis;
+    m->bt = 0;
+    for (c = m->clients; c; c = c->next)
+    {
+        if (!ISVISIBLE(c))
+            continue;
+        c->vprev = prev;
+        *tc = prev = c;
+        tc = &c->vnext;
+        m->bt++;
+    }
+    *tc = NULL;
+    m->vtail = prev;
+    m->vistags = m->tagset[m->seltags];
+    m->visdirty = 0;
+    return m->vis;
+}
+
 void view(const Arg *arg)
 {
     if (ISOVERVIEW(selmon))
@@ -2974,27 +4332,99 @@ void view(const Arg *arg)
     arrange(selmon);
 }
 
+static unsigned int
+winhash(Window w)
+{
+    unsigned long h = w * 2654435761UL;
+
+    return (h ^ (h >> 15)) & (wintabsize - 1);
+}
+
+// 查找 w 对应的登记项，不存在返回 NULL
+WinEntry *
+winlookup(Window w)
+{
+    unsigned int i;
+
+    if (!wintab || !w)
+        return NULL;
+    for (i = winhash(w); wintab[i].win; i = (i + 1) & (wintabsize - 1))
+        if (wintab[i].win == w)
+            return &wintab[i];
+    return NULL;
+}
+
+void
+winregister(Window w, int kind, void *p)
+{
+    WinEntry *e, *old = wintab;
+    unsigned int i, oldsize = wintabsize;
+
+    if ((e = winlookup(w)))
+    {
+        e->kind = kind;
+        e->p = p;
+        return;
+    }
+    // 装载率保持在 1/2 以下
+    if (2 * (wintabused + 1) > wintabsize)
+    {
+        wintabsize = wintabsize ? 2 * wintabsize : 64;
+        wintab = ecalloc(wintabsize, sizeof(WinEntry));
+        for (i = 0; i < oldsize; i++)
+            if (old[i].win)
+            {
+                for (e = &wintab[winhash(old[i].win)]; e->win;
+                     e = &wintab[(e - wintab + 1) & (wintabsize - 1)]);
+                *e = old[i];
+            }
+        free(old);
+    }
+    for (i = winhash(w); wintab[i].win; i = (i + 1) & (wintabsize - 1));
+    wintab[i].win = w;
+    wintab[i].kind = kind;
+    wintab[i].p = p;
+    wintabused++;
+}
+
+void
+winunregister(Window w)
+{
+    WinEntry *e;
+    unsigned int i, j, k;
+
+    if (!(e = winlookup(w)))
+        return;
+    // backward shift deletion, keeps probe chains intact without tombstones
+    i = e - wintab;
+    for (j = (i + 1) & (wintabsize - 1); wintab[j].win; j = (j + 1) & (wintabsize - 1))
+    {
+        k = winhash(wintab[j].win);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j)))
+        {
+            wintab[i] = wintab[j];
+            i = j;
+        }
+    }
+    wintab[i].win = 0;
+    wintabused--;
+}
+
 Client *
 wintoclient(Window w)
 {
-    Client *c;
-    Monitor *m;
+    WinEntry *e = winlookup(w);
 
-    for (m = mons; m; m = m->next)
-        for (c = m->clients; c; c = c->next)
-            if (c->win == w)
-                return c;
-    return NULL;
+    return e && e->kind == WinClient ? e->p : NULL;
 }
 
 Client *
 wintosystrayicon(Window w) {
-    Client *i = NULL;
+    WinEntry *e;
 
-    if (!showsystray || !w)
-        return i;
-    for (i = systray->icons; i && i->win != w; i = i->next) ;
-    return i;
+    if (!showsystray || !(e = winlookup(w)))
+        return NULL;
+    return e->kind == WinSystrayIcon ? e->p : NULL;
 }
 
 // 获取 w 所在的显示器
@@ -3002,16 +4432,17 @@ Monitor *
 wintomon(Window w)
 {
     int x, y;
-    Client *c;
-    Monitor *m;
+    WinEntry *e;
 
     if (w == root && getrootptr(&x, &y))
         return recttomon(x, y, 1, 1);
-    for (m = mons; m; m = m->next)
-        if (w == m->barwin)
-            return m;
-    if ((c = wintoclient(w)))
-        return c->mon;
+    if ((e = winlookup(w)))
+    {
+        if (e->kind == WinBar)
+            return e->p;
+        if (e->kind == WinClient)
+            return ((Client *)e->p)->mon;
+    }
     return selmon;
 }
 
@@ -3099,13 +4530,13 @@ zoom(const Arg *arg)
         toggleoverview(arg);
         selmon->seltags ^= 1;
         selmon->tagset[selmon->seltags] = c->tags;
-        if (c->isfloating || c == nexttiled(selmon->clients)) // 浮动窗口或者 c 已经是 master 窗口
+        if (c->isfloating || c == nexttiled(visclients(selmon))) // 浮动窗口或者 c 已经是 master 窗口
         {
             arrange(selmon);
             return;
         }
     }
-    if (c->isfloating || c == nexttiled(selmon->clients)) // 浮动窗口或者 c 已经是 master 窗口
+    if (c->isfloating || c == nexttiled(visclients(selmon))) // 浮动窗口或者 c 已经是 master 窗口
         return;
     pop(c);
 }
@@ -3124,11 +4555,11 @@ int main(int argc, char *argv[])
     system("prime-offload > /var/log/dwm/offload.log");
     setup();
 #ifdef __OpenBSD__
-    if (pledge("stdio rpath proc exec", NULL) == -1)
+    if (pledge("stdio rpath proc exec unix", NULL) == -1)
         die("pledge");
 #endif /* __OpenBSD__ */
     scan();
-    system(autostart);
+    spawn(&(Arg)SHCMD(autostart));
     run();
     cleanup();
     XCloseDisplay(dpy);
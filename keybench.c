@@ -0,0 +1,130 @@
+/* cc -std=c99 -O2 keybench.c -o keybench */
+
+#define _POSIX_C_SOURCE 200809L
+
+/* Compares key dispatch by scanning all bindings, as keypress() used to,
+ * with the keycode x modifier table built by grabkeys(). No X server is
+ * needed: keysyms and states are synthetic. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NKEYS      500
+#define NEVENTS    10000000
+#define LENGTH(X)  (sizeof X / sizeof X[0])
+
+/* X11/X.h modifier masks */
+#define ShiftMask   (1<<0)
+#define LockMask    (1<<1)
+#define ControlMask (1<<2)
+#define Mod1Mask    (1<<3)
+#define Mod2Mask    (1<<4)
+#define Mod4Mask    (1<<6)
+
+static unsigned int numlockmask = Mod2Mask;
+#define CLEANMASK(mask) (mask & ~(numlockmask | LockMask) & 0xff)
+#define KEYMODS(mask)   ((CLEANMASK(mask) & ShiftMask) | (CLEANMASK(mask) >> 1 & 0x7e))
+
+typedef struct {
+	unsigned int mod;
+	unsigned long keysym;
+	unsigned long calls;
+} Key;
+
+static Key keys[NKEYS];
+static unsigned long level0[256]; /* keycode -> keysym, stands in for XKeycodeToKeysym */
+static unsigned short keytab[256][128];
+static unsigned short keychain[NKEYS];
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+scan(unsigned int keycode, unsigned int state)
+{
+	unsigned long keysym = level0[keycode];
+	unsigned int i;
+
+	for (i = 0; i < LENGTH(keys); i++)
+		if (keysym == keys[i].keysym && CLEANMASK(keys[i].mod) == CLEANMASK(state))
+			keys[i].calls++;
+}
+
+static void
+table(unsigned int keycode, unsigned int state)
+{
+	unsigned int i;
+
+	for (i = keytab[keycode][KEYMODS(state)]; i; i = keychain[i - 1])
+		keys[i - 1].calls++;
+}
+
+static double
+run(void (*dispatch)(unsigned int, unsigned int), const unsigned int *codes, const unsigned int *states)
+{
+	double t = now();
+	int i;
+
+	for (i = 0; i < NEVENTS; i++)
+		dispatch(codes[i], states[i]);
+	return (now() - t) * 1e9 / NEVENTS;
+}
+
+int
+main(void)
+{
+	static const unsigned int mods[] = {
+		Mod4Mask, Mod4Mask|ShiftMask, Mod4Mask|ControlMask,
+		Mod4Mask|ControlMask|ShiftMask, Mod1Mask, Mod1Mask|ShiftMask,
+	};
+	unsigned int *codes, *states, i, code, k;
+	unsigned long total[2] = { 0 };
+	double ns[2];
+
+	for (code = 8; code < 256; code++)
+		level0[code] = 0x1000 + code;
+	for (i = 0; i < NKEYS; i++) {
+		keys[i].keysym = level0[8 + i % 248];
+		keys[i].mod = mods[i / 248 % LENGTH(mods)];
+	}
+	for (i = NKEYS; i-- > 0; ) {
+		code = keys[i].keysym - 0x1000;
+		keychain[i] = keytab[code][KEYMODS(keys[i].mod)];
+		keytab[code][KEYMODS(keys[i].mod)] = i + 1;
+	}
+
+	/* bound keys with and without Lock/NumLock, and some unbound ones */
+	codes = malloc(NEVENTS * sizeof(*codes));
+	states = malloc(NEVENTS * sizeof(*states));
+	if (!codes || !states)
+		return 1;
+	srand(1);
+	for (i = 0; i < NEVENTS; i++) {
+		k = rand() % (NKEYS + NKEYS / 4);
+		codes[i] = k < NKEYS ? keys[k].keysym - 0x1000 : 8 + rand() % 248;
+		states[i] = (k < NKEYS ? keys[k].mod : mods[rand() % LENGTH(mods)] | ControlMask)
+		          | (rand() & 1 ? LockMask : 0) | (rand() & 1 ? numlockmask : 0);
+	}
+
+	ns[0] = run(scan, codes, states);
+	for (i = 0; i < NKEYS; i++)
+		total[0] += keys[i].calls, keys[i].calls = 0;
+	ns[1] = run(table, codes, states);
+	for (i = 0; i < NKEYS; i++)
+		total[1] += keys[i].calls;
+
+	printf("%d bindings, %d key presses\n", NKEYS, NEVENTS);
+	printf("scan:  %8.2f ns/press, %lu calls\n", ns[0], total[0]);
+	printf("table: %8.2f ns/press, %lu calls\n", ns[1], total[1]);
+	free(codes);
+	free(states);
+	return total[0] != total[1];
+}
@@ -0,0 +1,260 @@
+/* See LICENSE file for copyright and license details. */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "status.h"
+#include "util.h"
+
+#define RINGSIZE  64  /* lines in flight, power of two */
+#define LINESIZE  320 /* name, color markup and text of one block */
+
+/* single producer, single consumer: head is only written by the status
+ * thread, tail only by the main thread */
+static struct {
+	char line[RINGSIZE][LINESIZE];
+	unsigned int head, tail;
+} ring;
+
+static const StatusItem *items;
+static size_t nitems;
+static char (*last)[LINESIZE]; /* last line pushed per item */
+static int wake[2] = { -1, -1 }, quit[2] = { -1, -1 };
+static pthread_t thread;
+static int started;
+
+static long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int
+readline(const char *path, char *buf, size_t size)
+{
+	FILE *fp;
+	int ok;
+
+	if (!(fp = fopen(path, "r")))
+		return 0;
+	ok = fgets(buf, size, fp) != NULL;
+	fclose(fp);
+	if (ok)
+		buf[strcspn(buf, "\n")] = '\0';
+	return ok;
+}
+
+static int
+push(const char *line)
+{
+	unsigned int head = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	char c = 0;
+
+	if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == RINGSIZE)
+		return 0;
+	strcpy(ring.line[head % RINGSIZE], line);
+	__atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+	/* a full pipe already holds a wakeup */
+	(void)!write(wake[1], &c, 1);
+	return 1;
+}
+
+static void *
+worker(void *arg)
+{
+	struct pollfd pfd = { .fd = quit[0], .events = POLLIN };
+	char buf[LINESIZE - 64], line[LINESIZE];
+	long long *due = ecalloc(nitems, sizeof(long long)), t, next;
+	size_t i;
+
+	do {
+		t = now();
+		next = t + 60000;
+		for (i = 0; i < nitems; i++) {
+			if (due[i] <= t) {
+				due[i] = t + MAX(items[i].interval, 1);
+				/* an item without a value removes its block */
+				if (!items[i].func(buf, sizeof(buf), items[i].fmt))
+					snprintf(line, sizeof(line), "%s", items[i].name);
+				else
+					snprintf(line, sizeof(line), "%s %s%s", items[i].name,
+					         items[i].color ? items[i].color : "", buf);
+				/* unchanged lines are not sent, a full ring is retried next time */
+				if (strcmp(line, last[i]) && push(line))
+					strcpy(last[i], line);
+			}
+			next = MIN(next, due[i]);
+		}
+	} while (poll(&pfd, 1, MAX(next - now(), 0)) <= 0);
+	free(due);
+	return NULL;
+}
+
+/* starts sampling items, returns the fd that becomes readable when lines
+ * are ready for status_pop, or -1 */
+int
+status_start(const StatusItem *it, size_t n)
+{
+	sigset_t all, old;
+	int i;
+
+	if (started || !n)
+		return -1;
+	items = it;
+	nitems = n;
+	last = ecalloc(n, sizeof(*last));
+	if (pipe(wake) < 0 || pipe(quit) < 0)
+		die("pipe:");
+	for (i = 0; i < 2; i++) {
+		fcntl(wake[i], F_SETFL, O_NONBLOCK);
+		fcntl(wake[i], F_SETFD, FD_CLOEXEC);
+		fcntl(quit[i], F_SETFD, FD_CLOEXEC);
+	}
+	/* created with all signals blocked, they belong to dwm's signalfd */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	if (pthread_create(&thread, NULL, worker, NULL))
+		die("pthread_create:");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	started = 1;
+	return wake[0];
+}
+
+/* copies the oldest pending line to line, returns 0 when there is none */
+int
+status_pop(char *line, size_t size)
+{
+	unsigned int tail = __atomic_load_n(&ring.tail, __ATOMIC_RELAXED);
+	char buf[64];
+
+	if (!started)
+		return 0;
+	if (tail == __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE)) {
+		/* drain before looking again, a line pushed after that wakes us anew */
+		while (read(wake[0], buf, sizeof(buf)) > 0)
+			;
+		if (tail == __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE))
+			return 0;
+	}
+	snprintf(line, size, "%s", ring.line[tail % RINGSIZE]);
+	__atomic_store_n(&ring.tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void
+status_stop(void)
+{
+	char c = 0;
+	int i;
+
+	if (!started)
+		return;
+	/* dwm is tearing down: a thread that cannot be told to quit is left
+	 * running, with its pipes and buffers, rather than waited for */
+	if (write(quit[1], &c, 1) != 1) {
+		fprintf(stderr, "dwm: status thread not stopped: %s\n", strerror(errno));
+		return;
+	}
+	pthread_join(thread, NULL);
+	for (i = 0; i < 2; i++) {
+		close(wake[i]);
+		close(quit[i]);
+	}
+	free(last);
+	started = 0;
+}
+
+int
+st_battery(char *buf, size_t size, const char *fmt)
+{
+	DIR *dir;
+	struct dirent *e;
+	char path[512], type[32], state[32], cap[16];
+	int found = 0;
+
+	if (!(dir = opendir("/sys/class/power_supply")))
+		return 0;
+	while (!found && (e = readdir(dir))) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/power_supply/%s/type", e->d_name);
+		if (!readline(path, type, sizeof(type)) || strcmp(type, "Battery"))
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/power_supply/%s/capacity", e->d_name);
+		if (!readline(path, cap, sizeof(cap)))
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/power_supply/%s/status", e->d_name);
+		if (!readline(path, state, sizeof(state)))
+			strcpy(state, "Unknown");
+		snprintf(buf, size, fmt, state, atoi(cap));
+		found = 1;
+	}
+	closedir(dir);
+	return found;
+}
+
+int
+st_cpu(char *buf, size_t size, const char *fmt)
+{
+	static unsigned long long pbusy, ptotal;
+	unsigned long long v[8] = { 0 }, busy, total = 0;
+	FILE *fp;
+	int i, n;
+
+	if (!(fp = fopen("/proc/stat", "r")))
+		return 0;
+	n = fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu %llu",
+	           &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose(fp);
+	if (n < 4)
+		return 0;
+	for (i = 0; i < 8; i++)
+		total += v[i];
+	busy = total - v[3] - v[4]; /* idle and iowait */
+	snprintf(buf, size, fmt, total == ptotal ? 0 : (int)(100 * (busy - pbusy) / (total - ptotal)));
+	pbusy = busy;
+	ptotal = total;
+	return 1;
+}
+
+int
+st_mem(char *buf, size_t size, const char *fmt)
+{
+	FILE *fp;
+	char line[128];
+	unsigned long total = 0, avail = 0, v;
+
+	if (!(fp = fopen("/proc/meminfo", "r")))
+		return 0;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "MemTotal: %lu", &v) == 1)
+			total = v;
+		else if (sscanf(line, "MemAvailable: %lu", &v) == 1)
+			avail = v;
+	}
+	fclose(fp);
+	if (!total || avail > total)
+		return 0;
+	snprintf(buf, size, fmt, (int)(100 * (total - avail) / total), (total - avail) / 1024);
+	return 1;
+}
+
+int
+st_time(char *buf, size_t size, const char *fmt)
+{
+	time_t t = time(NULL);
+	struct tm tm;
+
+	return localtime_r(&t, &tm) && strftime(buf, size, fmt, &tm);
+}
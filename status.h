@@ -0,0 +1,21 @@
+/* See LICENSE file for copyright and license details. */
+
+/* one status block sampled by the status thread, see config.h */
+typedef struct {
+	const char *name;       /* block name, as used on the status socket */
+	int (*func)(char *buf, size_t size, const char *fmt);
+	const char *fmt;        /* passed to func */
+	unsigned int interval;  /* ms between samples */
+	const char *color;      /* "#RRGGBBAAAA#RRGGBBAAAA" or NULL for the default */
+} StatusItem;
+
+/* Status thread */
+int status_start(const StatusItem *items, size_t n);
+int status_pop(char *line, size_t size);
+void status_stop(void);
+
+/* Samplers, return 0 when the value is not available */
+int st_battery(char *buf, size_t size, const char *fmt); /* fmt gets state (char *), capacity percent (int) */
+int st_cpu(char *buf, size_t size, const char *fmt);     /* fmt gets busy percent since last sample (int) */
+int st_mem(char *buf, size_t size, const char *fmt);     /* fmt gets used percent (int), used MiB (unsigned long) */
+int st_time(char *buf, size_t size, const char *fmt);    /* strftime(3) format */